@@ -1,9 +1,29 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE /* MAP_ANONYMOUS for the JIT's code buffer */
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
 #include<stdbool.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#include <stddef.h>
+#define HAVE_JIT 1 /* --dispatch jit emits x86-64 code */
+#else
+#define HAVE_JIT 0
+#endif
 
 #define NUMMEMORY 65536 /* maximum number of data words in memory */
 #define NUMREGS 8 /* number of machine registers */
@@ -17,18 +37,45 @@
 #define HALT 6
 #define NOOP 7
 
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#define HAVE_COMPUTED_GOTO 1 /* labels as values, for the threaded interpreter */
+#else
+#define ALWAYS_INLINE inline
+#define HAVE_COMPUTED_GOTO 0
+#endif
+
 //#define NOOPINSTRUCTION 0x1c00000
 
+#define SIMD_MIN_ASSOC 8 /* below this many ways the scalar tag scan is faster */
+
 enum actionType{cacheToProcessor, processorToCache, memoryToCache, cacheToMemory,
-    cacheToNowhere};
-
-int find_mem_start(int aluResult);
-int getTag(int aluResult);
-int getTagBits();
-int getBlockOffsetBits();
-int getSetOffsetBits();
-int getSetOffset(int aluResult);
-int getBlockOffset(int aluResult);
+    cacheToNowhere, processorToMemory, cacheToVictim, victimToCache, memoryToPrefetch,
+    memoryToStream, streamToCache};
+
+enum writePolicyType{WRITE_BACK, WRITE_THROUGH};
+
+//how the contents of neighbouring levels of a hierarchy relate
+enum inclusionType{NINE, INCLUSIVE, EXCLUSIVE};
+
+enum prefetchKind{PREFETCH_NONE, PREFETCH_NEXT_LINE, PREFETCH_STRIDE, PREFETCH_STREAM};
+
+enum coherenceProtocol{MESI, MOESI};
+
+//how --cores uses host threads, see the Multicore section
+enum parallelMode{PARALLEL_OFF, PARALLEL_STRICT, PARALLEL_RELAXED};
+
+enum dispatchMode{DISPATCH_SWITCH, DISPATCH_THREADED, DISPATCH_JIT};
+
+enum simpointMode{SIMPOINT_OFF, SIMPOINT_PROFILE, SIMPOINT_REPLAY};
+
+//per line of a coherent cache, invalid lines are COH_I
+enum cohState{COH_I, COH_S, COH_E, COH_O, COH_M};
+
+//what the core was waiting for, STALL_NONE collects cycles that overlap with execution
+enum stallCause{STALL_NONE, STALL_FETCH, STALL_LOAD, STALL_STORE, STALL_WRITEBACK, STALL_WRITE_BUFFER,
+    STALL_MSHR, STALL_TRANSLATION, NUM_STALL_CAUSES};
+
 void printAction(int address, int size, enum actionType type);
 int signExtend(int num);
 
@@ -36,29 +83,330 @@ int signExtend(int num);
 int blockSize;
 int numbrSets;
 int associt;
+const char *policyName = "lru";
+unsigned int randomSeed = 1;
+bool printTransfers = true;
+bool stackDistanceMode = false;
+bool sweepMode = false;
+int numThreads = 0; //sweep threads, 0 means one per online core
+#define MAX_LEVELS 8 /* most cache levels below the first one */
+int lowerLevels[MAX_LEVELS][4]; //block size, sets, associativity and hit latency of L2, L3, ...
+int numLowerLevels = 0;
+enum inclusionType inclusionPolicy = NINE;
+int icacheGeometry[3]; //block size, sets and associativity of a split instruction cache
+bool splitCaches = false;
+enum writePolicyType writePolicy = WRITE_BACK; //of the first level data cache
+bool writeAllocate = true;
+int writeBufferEntries = 8; //0 sends write-through stores straight down
+int writeBufferDrain = 4; //instructions between write buffer entries leaving
+int victimEntries = 0; //blocks in the data cache's victim cache, 0 for none
+enum prefetchKind prefetchKind = PREFETCH_NONE; //of the first level data cache
+int prefetchDegree = 1; //blocks fetched per trigger, or the depth of each stream buffer
+int prefetchDistance = 1; //how far ahead of the trigger the first prefetch is
+int prefetchLatency = 8; //instructions before a prefetched block has arrived
+int numStreamBuffers = 4;
+#define RPT_ENTRIES 64 /* entries in the stride prefetcher's reference prediction table */
+int numMshrs = 0; //miss status holding registers of the data cache, 0 for a blocking cache
+int mshrLatency = 20; //cycles a fill stays outstanding
+int hitLatency = 1; //cycles of a first level hit
+int missLatency = 1; //extra cycles every level spends on a miss before going below
+int memoryLatency = 100; //cycles to read a block from memory
+int writeLatency = 20; //cycles to write to memory
+#define DEFAULT_LOWER_HIT_LATENCY 10 /* hit latency of a --level that does not give one */
+int execLatency[8] = {1, 1, 1, 1, 1, 1, 1, 1}; //per opcode, cache access time not included
+int numCores = 1;
+enum coherenceProtocol coherenceProtocol = MESI;
+int coreQuantum = 1; //instructions each core runs before the next one gets a turn
+enum parallelMode parallelMode = PARALLEL_OFF;
+int vmPageSize = 0; //words per page, 0 runs without virtual memory
+int tlbGeometry[3] = {4, 4, 1}; //sets, associativity and hit latency of the TLB
+int tlb2Geometry[3] = {0, 0, 6}; //of the second level TLB, no sets for none
+bool viptIndexing = false;
+enum dispatchMode dispatchMode = HAVE_COMPUTED_GOTO ? DISPATCH_THREADED : DISPATCH_SWITCH;
+int numSectors = 0; //sectors per block of the first level data cache, 0 for an unsectored cache
+int sampleUnit = 0; //instructions measured per sampling unit, 0 simulates everything in detail
+int sampleWarming = 0; //detailed instructions before each unit
+long long samplePeriod = 0; //instructions from one unit to the next
+double sampleError = 3.0; //target half width of the CPI confidence interval, in percent of the estimate
+enum simpointMode simpointMode = SIMPOINT_OFF;
+const char *simpointFile = NULL; //written by --simpoint-profile, read by --simpoint-replay
+long long simpointInterval = 10000; //instructions per profiled interval
+int simpointMaxK = 10; //most clusters tried
+long long simpointWarming = 0; //detailed instructions before each replayed interval
+const char *checkpointSaveFile = NULL; //written by --checkpoint-save once checkpointAt instructions have run
+long long checkpointAt = 0;
+long long checkpointTrace = 65536; //accesses kept in a checkpoint to rewarm caches of another shape
+bool checkpointRestore = false; //the file argument is a checkpoint, not machine code
+
+//an instruction split into its fields, see decodeInstr()
+typedef struct decodedStruct {
+    int op;
+    int offset; //sign extended
+    unsigned char regA;
+    unsigned char regB;
+    unsigned char dest; //of add and nand
+    unsigned char handler; //what run() does with it: op, or NOOP for a word that is no instruction
+} decodedType;
 
 typedef struct stateStruct {
     int pc;
     int mem[NUMMEMORY];
     int reg[NUMREGS];
     int numMemory;
+    decodedType *decoded; //every word of mem decoded at load time and again whenever a store changes it
 } stateType;
 
-typedef struct blockType {
-    int valid;
-    int dirty;
-    int tag;
-    int addresses[];
-} blockType;
+//the word addresses a program touches, fetches and loads/stores alike, in order
+typedef struct accessTraceStruct {
+    int *addrs;
+    long length;
+    long capacity;
+} accessTrace;
+
+accessTrace oracleTrace;
 
+/*
+ * Everything needed to split a word address into tag, set and block offset,
+ * worked out once when the cache is built. When both the block size and the
+ * number of sets are powers of two the split is a pair of shifts and masks,
+ * otherwise it falls back to division.
+ */
+typedef struct geometryStruct {
+    int blockSize;
+    int numSets;
+    bool pow2;
+    int blockShift; //log2(blockSize)
+    int blockMask;
+    int setMask;
+    int tagShift; //log2(blockSize) + log2(numSets)
+} geometryType;
+
+struct cacheStruct;
+
+//a replacement policy, see the Replacement Policies section
+typedef struct replPolicyStruct {
+    const char *name;
+    void (*init)(struct cacheStruct* cache);
+    void (*touch)(struct cacheStruct* cache, int setNum, int way);
+    void (*fill)(struct cacheStruct* cache, int setNum, int way);
+    int (*victim)(struct cacheStruct* cache, int setNum);
+    void (*destroy)(struct cacheStruct* cache);
+    bool needsFuture; //the policy reads oracleTrace, which main records before building the cache
+    bool pow2Ways; //the policy only works with a power of two associativity
+    //lists the arrays its state is made of and returns how many, for checkpoints; NULL if it cannot be saved
+    int (*arrays)(struct cacheStruct* cache, void** ptrs, size_t* sizes);
+} replPolicy;
+
+//finds the first valid way of a set whose tag matches, or -1
+typedef int (*findWayFn)(const int* tags, const unsigned char* valid, int assoc, int tagNum);
+
+//the write buffer of a write-through cache, a ring of block sized entries
+typedef struct writeBufferStruct {
+    int numEntries;
+    int count;
+    int head; //the oldest entry
+    int drainInterval; //instructions between entries leaving
+    long long lastDrain;
+    int *blockStart;
+    unsigned char *present; //per word of each entry
+    int *data;
+    long long stalls;
+    long long drains;
+    long long coalesced;
+} writeBufferType;
+
+//one load or store instruction's entry in the stride prefetcher's reference prediction table
+typedef struct rptEntryStruct {
+    int pc;
+    int lastAddr;
+    int stride;
+    unsigned char state; //an rptState
+    bool valid;
+} rptEntry;
+
+//a data cache prefetcher, see the Prefetching section
+typedef struct prefetcherStruct {
+    enum prefetchKind kind;
+    int degree;
+    int distance;
+    int latency;
+    long long now; //the current instruction, kept up to date by run()
+    bool taggedHit; //the current access used a prefetched line
+    unsigned char *tagged; //per line, brought in by a prefetch and not used yet
+    long long *issuedAt; //per line, when its prefetch was issued
+    rptEntry *rpt; //stride only
+    //stream buffers: numStreams FIFOs of up to degree blocks each
+    int numStreams;
+    int *streamCount;
+    int *streamNext; //first word of the block each stream fetches next
+    long long *streamUsed; //when each stream was last hit or allocated
+    int *streamStart; //per entry, -1 once a store has made it stale
+    long long *streamIssued; //per entry
+    int *streamData;
+    long long issued;
+    long long useful;
+    long long late; //used within latency instructions of being issued
+    long long unused; //dropped before any use
+} prefetcherType;
+
+//the outstanding misses of a lockup-free cache, see the Miss Status Holding Registers section
+typedef struct mshrFileStruct {
+    int numEntries;
+    int count;
+    int latency;
+    long long now; //the current cycle, kept up to date by run()
+    long long stallCycles; //spent waiting for a free entry
+    long long lastEvent; //time the occupancy was last brought up to date
+    int *blockStart;
+    long long *readyAt;
+    long long *occupancy; //cycles spent with each number of entries busy, 0 to numEntries
+    long long primary;
+    long long secondary; //merged into an outstanding entry
+    long long hitsUnderMiss;
+    long long fullStalls;
+} mshrFileType;
+
+//the cycle count of one run, shared by every cache of its hierarchy
+typedef struct timingStruct {
+    enum stallCause cause; //where cycles charged by the caches go
+    int memoryLatency;
+    int writeLatency;
+    long long base; //cycles the instructions take when every access hits the first level
+    long long stalls[NUM_STALL_CAUSES];
+} timingType;
+
+//the snooping bus between the private caches of a multicore run, see the Coherence section
+typedef struct busStruct {
+    enum coherenceProtocol protocol;
+    struct cacheStruct **caches;
+    int numCaches;
+    long long reads;
+    long long readExclusives;
+    long long upgrades;
+    long long writebacks; //of dirty blocks, evicted or flushed for another core's read
+    long long invalidations; //lines dropped because another core wrote
+    long long interventions; //misses served by another cache instead of from below
+} busType;
+
+//address translation in front of the first level caches, see the Virtual Memory section
+typedef struct vmStruct {
+    int pageSize;
+    int numPages;
+    int pageTable; //physical address of the page table, one entry per virtual page
+    int numFrames; //frames below the page table
+    int nextFrame;
+    int *image; //the program as loaded, copied into a frame when its page is first touched
+    bool vipt;
+    struct cacheStruct *tlb;
+    struct cacheStruct *tlb2; //NULL without a second level TLB
+    long long walks;
+    long long faults;
+} vmType;
+
+#define TRACE_FETCH 1 /* flags of a recorded access */
+#define TRACE_WRITE 2
+
+//one access of a recorded run, also the layout of the accesses at the end of a checkpoint
+typedef struct accessRecordStruct {
+    int32_t addr;
+    int32_t flags;
+} accessRecord;
+
+//the last accesses of a run, kept while --checkpoint-save runs up to its checkpoint
+typedef struct accessRecorderStruct {
+    accessRecord *ring;
+    long long length;
+    long long count; //accesses seen so far, the ring holds the last length of them
+} accessRecorder;
+
+/*
+ * The cache is stored as a structure of arrays sized from the geometry at
+ * startup. A "line" is the flat index set*assoc + way; tags, valid and dirty
+ * bits and the replacement state for a set sit next to each other so a tag
+ * scan stays within a couple of host cache lines. Block data lives in its own
+ * contiguous arena at data[line*blockSize].
+ */
 typedef struct cacheStruct {
-    struct blockType cacheArray[256][256];
+    geometryType geo;
+    int assoc;
+    int *tags;
+    unsigned char *valid;
+    unsigned char *dirty;
+    int *numValid; //valid ways in each set, the policy is only asked for a victim once it is full
+    int *data;
+    findWayFn findWay; //tag scan picked for this host when the cache is built
+    const replPolicy *policy;
+    void *repl; //the policy's own per-set state
+    long long hits;
+    long long misses;
+    long long writebacks;
+    //the hierarchy: next is the level below (NULL for memory), uppers are the levels that fill from this one
+    struct cacheStruct *next;
+    struct cacheStruct **uppers;
+    int numUppers;
+    enum inclusionType inclusion;
+    long long backInvalidations; //lines of this cache dropped to keep an inclusive level below it inclusive
+    struct cacheStruct *peer; //with split caches, the other first level cache (instruction <-> data)
+    bool readOnly; //the instruction cache of a split pair, only ever fetched from
+    enum writePolicyType writePolicy;
+    bool writeAllocate;
+    writeBufferType *writeBuffer; //write-through only, NULL to write straight down
+    long long fillWords; //words brought in from below
+    long long writeWords; //words written below, by writebacks or write-through
+    struct cacheStruct *victims; //victim cache of the data cache, NULL if there is none
+    prefetcherType *prefetcher; //the data cache's prefetcher, NULL if there is none
+    mshrFileType *mshrs; //NULL for a blocking cache
+    timingType *timing; //NULL if nothing is timed
+    int hitLatency; //charged by lower levels only, first level hits are part of each instruction's base time
+    int missLatency;
+    busType *bus; //multicore runs only, NULL otherwise
+    unsigned char *coh; //per line, an cohState
+    unsigned char *stolen; //per block of memory, invalidated by another core's write since we last had it
+    bool writeIntent; //the fill in progress is for a store
+    long long coherenceMisses;
+    vmType *vm; //shared by the first level caches, NULL without --vm
+    accessRecorder *recorder; //the first level data cache's while a checkpoint is coming up, NULL otherwise
+    //sectored caches only, see the Sectors section; sectorValid is NULL otherwise
+    int numSectors;
+    int sectorSize;
+    unsigned char *sectorValid;
+    unsigned char *sectorDirty;
+    unsigned char *wordUsed;
+    int fillSector; //the sector the fill in progress is for
+    long long sectorMisses; //the block was there, the sector was not
+    long long unusedWords; //filled and dropped again without being used
 } cacheType;
 
 
 /**************** Main Function Declaration *****************************/
-cacheType* memToCache(cacheType* cache, int aluResult, stateType* state);
-int searchCache(cacheType* cache, stateType* state, int aluResult);
+int memToCache(cacheType* cache, stateType* state, int setNum, int tagNum, int memStart);
+int sectorMiss(cacheType* cache, stateType* state, int aluResult);
+void fillSectors(cacheType* cache, stateType* state, int line, int memStart);
+void writeSectors(cacheType* cache, int line, int memStart, stateType* state);
+void copyDirtyWords(cacheType* cache, int line, int from, int to, int* dst);
+long long unusedWords(cacheType* cache, int line);
+void fillLine(cacheType* cache, stateType* state, int line, int setNum, int tagNum, int memStart,
+              enum actionType type);
+void writeToLevel(cacheType* lower, stateType* state, int aluResult, const int* src, int count);
+void writeBelow(cacheType* cache, stateType* state, int aluResult, const int* src, int count);
+writeBufferType* newWriteBuffer(int numEntries, int drainInterval, int blkSize);
+void freeWriteBuffer(writeBufferType* buffer);
+void retireOldest(cacheType* cache, stateType* state);
+int lookupCache(cacheType* cache, int aluResult);
+void invalidateLine(cacheType* cache, int line);
+void drainBufferedBlock(cacheType* cache, stateType* state, int memStart, int count);
+void untagLine(cacheType* cache, int line);
+void usePrefetched(cacheType* cache, int line);
+void freePrefetcher(prefetcherType* pf);
+void streamInvalidate(cacheType* cache, int memStart, int count);
+void mshrMiss(cacheType* cache, int memStart);
+void mshrHit(cacheType* cache, int aluResult);
+void freeMshrFile(mshrFileType* m);
+enum cohState busFill(cacheType* cache, stateType* state, int memStart, int* dst, bool exclusive);
+void busWrite(cacheType* cache, int line);
+long long totalCycles(const timingType* t);
+void predecode(stateType* state);
+void freeState(stateType* state);
 
 int field0(int instruction){
     return( (instruction>>19) & 0x7);
@@ -125,6 +473,9 @@ void printState(stateType *statePtr){
 }
 void printAction(int address, int size, enum actionType type)
 {
+    if (!printTransfers) {
+        return;
+    }
     printf("transferring word [%i-%i] ", address, address + size - 1);
     if (type == cacheToProcessor) {
         printf("from the cache to the processor\n");
@@ -136,6 +487,18 @@ void printAction(int address, int size, enum actionType type)
         printf("from the cache to the memory\n");
     } else if (type == cacheToNowhere) {
         printf("from the cache to nowhere\n");
+    } else if (type == processorToMemory) {
+        printf("from the processor to the memory\n");
+    } else if (type == cacheToVictim) {
+        printf("from the cache to the victim cache\n");
+    } else if (type == victimToCache) {
+        printf("from the victim cache to the cache\n");
+    } else if (type == memoryToPrefetch) {
+        printf("from the memory to the cache as a prefetch\n");
+    } else if (type == memoryToStream) {
+        printf("from the memory to the stream buffer\n");
+    } else if (type == streamToCache) {
+        printf("from the stream buffer to the cache\n");
     }
 }
 
@@ -147,459 +510,5841 @@ int signExtend(int num){
     return num;
 }
 
-void print_stats(int n_instrs){
-    printf("INSTRUCTIONS: %d\n", n_instrs);
-}
-
-double logbase (double y, int b)
+/*
+ * run() never decodes an instruction word itself. loadState() decodes all of
+ * memory up front and every store decodes the word it writes, so the entry
+ * at the pc is always the instruction the fetch returns. The fetch still
+ * goes through the caches to be counted; only its value goes unused. The
+ * table is indexed by the address the program sees, virtual under --vm.
+ */
+static ALWAYS_INLINE decodedType decodeInstr(int instr)
 {
-    double lg;
-    lg = log10(y)/log10(b);
-    return ceil((lg)); //returns us the ceiling of our logs
+    decodedType d;
+    d.op = opcode(instr);
+    d.offset = signExtend(field2(instr));
+    d.regA = (unsigned char) field0(instr);
+    d.regB = (unsigned char) field1(instr);
+    d.dest = (unsigned char) (field2(instr) & 0x7);
+    d.handler = (unsigned char) (d.op >= ADD && d.op <= NOOP ? d.op : NOOP);
+    return d;
 }
 
-int find_mem_start(int aluResult){
+void printCacheStats(const char* name, cacheType* cache){
+    long long accesses = cache->hits + cache->misses;
+    printf("%sHITS: %lld\n", name, cache->hits);
+    printf("%sMISSES: %lld\n", name, cache->misses);
+    printf("%sWRITEBACKS: %lld\n", name, cache->writebacks);
+    printf("%sMISS RATE: %.4f%%\n", name, accesses ? 100.0 * cache->misses / accesses : 0.0);
+    if(cache->next != NULL && cache->inclusion == INCLUSIVE){
+        printf("%sBACK INVALIDATIONS: %lld\n", name, cache->backInvalidations);
+    }
+    if(cache->bus != NULL){
+        printf("%sCOHERENCE MISSES: %lld\n", name, cache->coherenceMisses);
+    }
+    printf("%sFILL WORDS: %lld\n", name, cache->fillWords);
+    printf("%sWRITE WORDS: %lld\n", name, cache->writeWords);
+    if(cache->sectorValid != NULL){
+        //lines still in the cache count too, nothing will use their words any more
+        long long unused = cache->unusedWords;
+        for(int line=0; line<cache->geo.numSets * cache->assoc; line++){
+            if(cache->valid[line]){
+                unused += unusedWords(cache, line);
+            }
+        }
+        printf("%sBLOCK MISSES: %lld\n", name, cache->misses - cache->sectorMisses);
+        printf("%sSECTOR MISSES: %lld\n", name, cache->sectorMisses);
+        printf("%sUNUSED FILL WORDS: %lld\n", name, unused);
+    }
+    if(cache->victims != NULL){
+        printf("%sVICTIM HITS: %lld\n", name, cache->victims->hits);
+        printf("%sVICTIM MISSES: %lld\n", name, cache->victims->misses);
+        printf("%sVICTIM WRITEBACKS: %lld\n", name, cache->victims->writebacks);
+    }
+    if(cache->prefetcher != NULL){
+        prefetcherType* pf = cache->prefetcher;
+        //stream buffer hits are still counted as misses, prefetched lines turn misses into hits
+        long long unprefetched = pf->kind == PREFETCH_STREAM ? cache->misses : cache->misses + pf->useful;
+        printf("%sPREFETCHES: %lld\n", name, pf->issued);
+        printf("%sPREFETCH HITS: %lld\n", name, pf->useful);
+        printf("%sPREFETCH LATE: %lld\n", name, pf->late);
+        printf("%sPREFETCH UNUSED: %lld\n", name, pf->unused);
+        printf("%sPREFETCH ACCURACY: %.4f%%\n", name, pf->issued ? 100.0 * pf->useful / pf->issued : 0.0);
+        printf("%sPREFETCH COVERAGE: %.4f%%\n", name, unprefetched ? 100.0 * pf->useful / unprefetched : 0.0);
+    }
+    if(cache->mshrs != NULL){
+        mshrFileType* m = cache->mshrs;
+        long long busy = 0;
+        long long weighted = 0;
+        for(int k=1; k<=m->numEntries; k++){
+            busy += m->occupancy[k];
+            weighted += k * m->occupancy[k];
+        }
+        printf("%sMSHR PRIMARY MISSES: %lld\n", name, m->primary);
+        printf("%sMSHR SECONDARY MISSES: %lld\n", name, m->secondary);
+        printf("%sHITS UNDER MISS: %lld\n", name, m->hitsUnderMiss);
+        printf("%sMSHR FULL STALLS: %lld\n", name, m->fullStalls);
+        printf("%sMSHR STALL CYCLES: %lld\n", name, m->stallCycles);
+        printf("%sMEMORY LEVEL PARALLELISM: %.4f\n", name, busy ? (double) weighted / busy : 0.0);
+        for(int k=0; k<=m->numEntries; k++){
+            printf("%sMSHR OCCUPANCY %d: %lld cycles\n", name, k, m->occupancy[k]);
+        }
+    }
+    if(cache->writeBuffer != NULL){
+        printf("%sWRITE BUFFER DRAINS: %lld\n", name, cache->writeBuffer->drains);
+        printf("%sWRITE BUFFER COALESCED: %lld\n", name, cache->writeBuffer->coalesced);
+        printf("%sWRITE BUFFER STALLS: %lld\n", name, cache->writeBuffer->stalls);
+    }
+}
 
-    return  aluResult - (aluResult%blockSize);
+/*
+ * AMAT is the first level hit latency plus the stall cycles per first level
+ * access, so it is what accesses cost the core after any overlap.
+ */
+void printTiming(const char* name, long long n_instrs, cacheType* icache, cacheType* dcache){
+    static const char* causes[NUM_STALL_CAUSES] = {"", "FETCH", "LOAD", "STORE", "WRITEBACK",
+        "WRITE BUFFER", "MSHR", "TRANSLATION"};
+    timingType* t = dcache->timing;
+    long long cycles = totalCycles(t);
+    long long accesses = dcache->hits + dcache->misses;
+    if(icache != dcache){
+        accesses += icache->hits + icache->misses;
+    }
+    printf("%sCYCLES: %lld\n", name, cycles);
+    printf("%sCPI: %.4f\n", name, n_instrs ? (double) cycles / n_instrs : 0.0);
+    printf("%sAMAT: %.4f\n", name, accesses ? dcache->hitLatency + (double) (cycles - t->base) / accesses : 0.0);
+    printf("%sSTALL CYCLES: %lld\n", name, cycles - t->base);
+    for(int c=STALL_NONE+1; c<NUM_STALL_CAUSES; c++){
+        if(c == STALL_TRANSLATION && dcache->vm == NULL){
+            continue;
+        }
+        printf("%sSTALL CYCLES %s: %lld\n", name, causes[c], t->stalls[c]);
+    }
 }
 
-//this returns the number of bits we will need for the tag
-int getTag(int aluResult){
-    int otherBits = 32 - getTagBits();
-    //printf("Tag Results: %d\n", aluResult >> otherBits);
-    return aluResult >> otherBits;
+//hits, misses and miss rate of a TLB, each line starting with name
+void printTlbStats(const char* name, cacheType* tlb){
+    long long accesses = tlb->hits + tlb->misses;
+    printf("%sHITS: %lld\n", name, tlb->hits);
+    printf("%sMISSES: %lld\n", name, tlb->misses);
+    printf("%sMISS RATE: %.4f%%\n", name, accesses ? 100.0 * tlb->misses / accesses : 0.0);
 }
 
-int getTagBits(){
-    return 32 - (getBlockOffsetBits() + getSetOffsetBits());
+/*
+ * A single cache prints plain counters. Otherwise each level gets an L1, L2,
+ * ... prefix, and split first level caches are L1I and L1D.
+ */
+void print_stats(long long n_instrs, cacheType* icache, cacheType* dcache){
+    printf("INSTRUCTIONS: %lld\n", n_instrs);
+    if(dcache->timing != NULL){
+        printTiming("", n_instrs, icache, dcache);
+    }
+    if(dcache->vm != NULL){
+        vmType* vm = dcache->vm;
+        printTlbStats("TLB ", vm->tlb);
+        if(vm->tlb2 != NULL){
+            printTlbStats("TLB2 ", vm->tlb2);
+        }
+        printf("PAGE WALKS: %lld\n", vm->walks);
+        printf("PAGE FAULTS: %lld\n", vm->faults);
+        printf("PAGE WALK CYCLES: %lld\n", dcache->timing != NULL ? dcache->timing->stalls[STALL_TRANSLATION] : 0);
+    }
+    if(icache == dcache && dcache->next == NULL){
+        printCacheStats("", dcache);
+        return;
+    }
+    if(icache != dcache){
+        printCacheStats("L1I ", icache);
+        printCacheStats("L1D ", dcache);
+    }else{
+        printCacheStats("L1 ", dcache);
+    }
+    char name[16];
+    int level = 2;
+    for(cacheType* c = dcache->next; c != NULL; c = c->next, level++){
+        snprintf(name, sizeof(name), "L%d ", level);
+        printCacheStats(name, c);
+    }
 }
 
-//this returns the number of bits we need for the block offset
-int getBlockOffsetBits(){
-    return(int)logbase(blockSize, 2); //tells us how many bits we need for the blockOffset
+//returns n's log base 2, or -1 if n is not a power of two
+int log2Exact(int n)
+{
+    int bits = 0;
+    while((1 << bits) < n)
+    {
+        bits++;
+    }
+    return (1 << bits) == n ? bits : -1;
 }
 
-//this returns the number of bits we will need for the set offset.
-int getSetOffsetBits(){
-    return (int)logbase(numbrSets,2); //tells us how many bits we need for the setOffset
+geometryType makeGeometry(int blkSize, int numSets)
+{
+    geometryType geo;
+    int blockBits = log2Exact(blkSize);
+    int setBits = log2Exact(numSets);
+    geo.blockSize = blkSize;
+    geo.numSets = numSets;
+    geo.pow2 = blockBits >= 0 && setBits >= 0;
+    geo.blockShift = blockBits;
+    geo.blockMask = blkSize - 1;
+    geo.setMask = numSets - 1;
+    geo.tagShift = blockBits + setBits;
+    return geo;
 }
 
-int getSetOffset(int aluResult)
+/*
+ * Address decomposition. The pow2 argument is passed as a constant from the
+ * specialized copies of run() so the unused path folds away; other callers
+ * pass geo->pow2.
+ */
+static ALWAYS_INLINE int getTag(const geometryType* geo, int aluResult, bool pow2)
 {
-    int mask = 0;
-    for(int i=0; i<getSetOffsetBits(); i++)
+    if(pow2)
     {
-        mask|= 1 << i;
+        return aluResult >> geo->tagShift;
     }
-    mask = mask << getBlockOffsetBits();
-    return signExtend(aluResult&mask);
+    return aluResult / geo->blockSize / geo->numSets;
 }
 
-int getBlockOffset(int aluResult)
+static ALWAYS_INLINE int getSetOffset(const geometryType* geo, int aluResult, bool pow2)
 {
-    int mask =0;
-    for(int i=0; i<getSetOffsetBits(); i++)
+    if(pow2)
     {
-        mask|= 1 << i;
+        return (aluResult >> geo->blockShift) & geo->setMask;
     }
-    return signExtend(aluResult&mask);
+    return (aluResult / geo->blockSize) % geo->numSets;
 }
 
-
-
-
-void cacheToMem(cacheType* cache, int aluResult, stateType* state)
+static ALWAYS_INLINE int getBlockOffset(const geometryType* geo, int aluResult, bool pow2)
 {
-    printAction(find_mem_start(aluResult), blockSize, cacheToMemory);
-    //printf("In cache to mem\n");
-    int wayNum = searchCache(cache, state, aluResult);
-    int setNum = getSetOffset(aluResult);
-    int memStart = find_mem_start(aluResult);
-    for(int i=0; i<associt; i++)
+    if(pow2)
     {
-        state->mem[memStart] = cache->cacheArray[setNum][wayNum].addresses[i];
-        memStart++;
+        return aluResult & geo->blockMask;
     }
+    return aluResult % geo->blockSize;
 }
 
-int cacheToRegs(cacheType* cache, stateType* state, int aluResult, int instr)
+static ALWAYS_INLINE int find_mem_start(const geometryType* geo, int aluResult, bool pow2)
 {
-    printAction(aluResult, 1, cacheToProcessor);
-   // printf("In cache to regs\n");
-    int wayNum = searchCache(cache, state, aluResult);
-    int setNum = getSetOffset(aluResult);
-    int lineNum = aluResult%blockSize;
-    //printf("Whats in the block: %d\n", cache->cacheArray[setNum][wayNum].addresses[lineNum]);
-    return cache->cacheArray[setNum][wayNum].addresses[lineNum];
+    return aluResult - getBlockOffset(geo, aluResult, pow2);
 }
 
-void regsToCache(cacheType* cache, int aluResult, stateType* state, int regA)
+static ALWAYS_INLINE int findWayScalar(const int* tags, const unsigned char* valid, int assoc, int tagNum)
 {
-    printAction(aluResult, 0, processorToCache);
-    int wayNum = searchCache(cache, state, aluResult);
-   // printf("Way number: %d\n", wayNum);
-    int setNum = getSetOffset(aluResult);
-    //printf("Set Number: %d\n", setNum);
-    int memLine = aluResult%blockSize;
-    //printf("Mem line: %d\n", memLine);
-
-    cache->cacheArray[setNum][wayNum].addresses[memLine] = regA;
-    cache->cacheArray[setNum][wayNum].dirty = 1;
+    for(int i=0; i<assoc; i++)
+    {
+        if(tags[i] == tagNum && valid[i] == 1)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
 
-    //printf("Dirty bit: %d\n", cache->cacheArray[setNum][wayNum].dirty);
+static int findWayScalarFn(const int* tags, const unsigned char* valid, int assoc, int tagNum)
+{
+    return findWayScalar(tags, valid, assoc, tagNum);
 }
 
-int searchCache(cacheType* cache, stateType* state, int aluResult)
+#ifdef HAVE_X86_SIMD
+//walks the matching lanes of a compare mask in way order and returns the first valid one
+static ALWAYS_INLINE int firstValidMatch(const unsigned char* valid, int base, unsigned int mask)
 {
-   // printf("In search Cache\n");
-    int setNum = getSetOffset(aluResult);
-    //printf("Set Number: %d\n", setNum);
-    int tagNum = getTag(aluResult);
-    //printf("Tag Number: %d\n", tagNum);
-    int result = -1;
-    blockType block;
-    for(int i=0; i<associt; i++)
+    while(mask != 0)
     {
-        block = cache->cacheArray[setNum][i];
-        //printf("Tag Num for Block: %d\n", block.tag);
-       // printf("Valid bit for Block: %d\n", block.valid);
-        if(block.tag == tagNum && block.valid == 1 )
+        int way = base + __builtin_ctz(mask);
+        if(valid[way] == 1)
         {
-            result = i;
-           // printf("IN CACHE\n");
-            printAction(find_mem_start(aluResult), blockSize, cacheToNowhere);
+            return way;
         }
+        mask &= mask - 1;
     }
-    //printf("Before result = -1\n");
-   if(result == -1)
-   {
-       cache = memToCache(cache, aluResult, state);
-       result = searchCache(cache, state, aluResult);
-       //printf("Result in result = -1: %d\n", result);
-   }
-    return result;
+    return -1;
 }
 
-cacheType* memToCache(cacheType* cache, int aluResult, stateType* state)
+__attribute__((target("sse2")))
+static int findWaySSE2(const int* tags, const unsigned char* valid, int assoc, int tagNum)
 {
-
-    //printf("In Mem to Cache\n");
-    int setNum = getSetOffset(aluResult);
-   // printf("Set number: %d \n", setNum);
-    int tagNum = getTag(aluResult);
-   // printf("Tag number: %d\n", tagNum);
-    int wayNum = -1;
-    blockType* block;
-    //TODO: Make sure to check all the blocks to make sure that it is in cache
-    for(int i=associt-1; i >=0; i--)
+    __m128i key = _mm_set1_epi32(tagNum);
+    int i = 0;
+    for(; i + 8 <= assoc; i += 8)
     {
-        block = &cache->cacheArray[setNum][i];
-        if(block->valid == 0)
+        __m128i lo = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)&tags[i]), key);
+        __m128i hi = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)&tags[i + 4]), key);
+        unsigned int mask = _mm_movemask_ps(_mm_castsi128_ps(lo)) |
+                            (_mm_movemask_ps(_mm_castsi128_ps(hi)) << 4);
+        int way = firstValidMatch(valid, i, mask);
+        if(way != -1)
         {
-            wayNum = i;
-            break;
+            return way;
         }
     }
-    int memStart = find_mem_start(aluResult);
-    printAction(memStart, blockSize, memoryToCache);
-    //printf("Mem Start: %d\n", memStart);
-    //block = cacheArray[setNum][associt-1];
+    int way = findWayScalar(tags + i, valid + i, assoc - i, tagNum);
+    return way == -1 ? -1 : i + way;
+}
 
-    if(wayNum == -1)
+__attribute__((target("avx2")))
+static int findWayAVX2(const int* tags, const unsigned char* valid, int assoc, int tagNum)
+{
+    __m256i key = _mm256_set1_epi32(tagNum);
+    int i = 0;
+    for(; i + 16 <= assoc; i += 16)
     {
-        block = &cache->cacheArray[setNum][associt-1];
-        if(block->dirty == 1)
-        {
-            cacheToMem(cache, aluResult, state);
-        }
-        for(int i=0; i<blockSize; i++)
-        {
-           // printf("Mem Addrs: %d\n", state->mem[memStart]);
-            block->addresses[i] = state->mem[memStart];
-           // printf("Block Mem Addrs: %d\n", block->addresses[i]);
-            memStart++;
-        }
-        block->tag = tagNum;
-        block->valid=1;
-        for(int i=0; i<associt; i++)
+        __m256i lo = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)&tags[i]), key);
+        __m256i hi = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)&tags[i + 8]), key);
+        unsigned int mask = _mm256_movemask_ps(_mm256_castsi256_ps(lo)) |
+                            (_mm256_movemask_ps(_mm256_castsi256_ps(hi)) << 8);
+        int way = firstValidMatch(valid, i, mask);
+        if(way != -1)
         {
-            cache->cacheArray[setNum][i+1] = cache->cacheArray[setNum][i];
+            return way;
         }
-        //printf("Addrs: %d\n", cache->cacheArray[setNum][0].addresses[0]);
-        cache->cacheArray[setNum][0] = *block;
     }
-    else {
-        block = &cache->cacheArray[setNum][wayNum];
-        if(block->dirty == 1)
+    if(i + 8 <= assoc)
+    {
+        __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)&tags[i]), key);
+        int way = firstValidMatch(valid, i, _mm256_movemask_ps(_mm256_castsi256_ps(eq)));
+        if(way != -1)
         {
-            cacheToMem(cache, aluResult, state);
-        }
-
-        for (int i = 0; i < blockSize; i++) {
-            //printf("Mem Address: %d\n", state->mem[memStart]);
-            block->addresses[i] = state->mem[memStart];
-            memStart++;
+            return way;
         }
-        block->tag = tagNum;
-        block->valid = 1;
-
-        for (int i = 0; i < wayNum; i++) {
-            cache->cacheArray[setNum][i + 1] = cache->cacheArray[setNum][i];
-        }
-        cache->cacheArray[setNum][0] = *block;
-        //printf("Tag for new block: %d\n", cache->cacheArray[setNum][0].tag);
-        //printf("Valid bit for new block: %d\n", cache->cacheArray[setNum][0].valid);
-        /*for (int i = 0; i < numbrSets; i++) {
-            //printf("first foor loop\n");
-            for (int j = 0; j < associt; j++) {
-                // printf("second for loop\n");
-                //printf("Tag at block %d: %d\n", i, cache->cacheArray[i][j].valid);
-            }
-        }*/
+        i += 8;
     }
-    return cache;
+    int way = findWayScalar(tags + i, valid + i, assoc - i, tagNum);
+    return way == -1 ? -1 : i + way;
 }
+#endif
 
+//picks the widest tag scan this host supports
+findWayFn selectFindWay(int assoc)
+{
+    if(assoc < SIMD_MIN_ASSOC)
+    {
+        return findWayScalarFn;
+    }
+#ifdef HAVE_X86_SIMD
+    if(__builtin_cpu_supports("avx2"))
+    {
+        return findWayAVX2;
+    }
+    if(__builtin_cpu_supports("sse2"))
+    {
+        return findWaySSE2;
+    }
+#endif
+    return findWayScalarFn;
+}
 
-void run(stateType* state, cacheType* cache){
+//rebuilds the first word address of the block held in a line from its tag and set
+int lineAddress(cacheType* cache, int line)
+{
+    const geometryType* geo = &cache->geo;
+    int setNum = line / cache->assoc;
+    if(geo->pow2)
+    {
+        return (cache->tags[line] << geo->tagShift) | (setNum << geo->blockShift);
+    }
+    return (cache->tags[line] * geo->numSets + setNum) * geo->blockSize;
+}
 
-    // Reused variables;
-    int instr = 0;
-    int regA = 0;
-    int regB = 0;
-    int offset = 0;
-    int branchTarget = 0;
-    int aluResult = 0;
+//calloc that gives up on the whole run if the host is out of memory
+void* allocOrDie(size_t count, size_t size)
+{
+    void* ptr = calloc(count, size);
+    if(ptr == NULL && count != 0)
+    {
+        printf("Out of memory allocating %zu bytes\n", count * size);
+        exit(-1);
+    }
+    return ptr;
+}
 
-    int total_instrs = 0;
+/*
+ * xorshift32, used by the random and BRRIP policies. Each cache keeps its own
+ * generator seeded from randomSeed so runs are repeatable.
+ */
+static ALWAYS_INLINE unsigned int nextRandom(unsigned int* rng)
+{
+    unsigned int x = *rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *rng = x;
+    return x;
+}
 
-    // Primary loop
-    while(1){
-        total_instrs++;
+/**************** Replacement Policies *****************************/
+/*
+ * Each policy keeps its own per-set state behind cache->repl. touch is called
+ * on a hit and fill after a block is brought into a way; either may be NULL.
+ * victim is only asked once every way of the set is valid, until then the
+ * last invalid way is filled. arrays lets checkpoints save and restore the
+ * state without knowing its layout.
+ */
 
-        //printState(state);
+//LRU: the recency order of each set is a doubly linked list of ways, most recent at the head
+typedef struct lruStateStruct {
+    int *prev;
+    int *next;
+    int *head;
+    int *tail;
+} lruState;
 
+void lruInit(cacheType* cache)
+{
+    int numLines = cache->geo.numSets * cache->assoc;
+    lruState* lru = (lruState*) allocOrDie(1, sizeof(lruState));
+    lru->prev = (int*) allocOrDie(numLines, sizeof(int));
+    lru->next = (int*) allocOrDie(numLines, sizeof(int));
+    lru->head = (int*) allocOrDie(cache->geo.numSets, sizeof(int));
+    lru->tail = (int*) allocOrDie(cache->geo.numSets, sizeof(int));
+    //every set starts out ordered way 0 first, way assoc-1 last
+    for(int i=0; i<numLines; i++)
+    {
+        int way = i % cache->assoc;
+        lru->prev[i] = way - 1;
+        lru->next[i] = way == cache->assoc-1 ? -1 : way + 1;
+    }
+    for(int i=0; i<cache->geo.numSets; i++)
+    {
+        lru->head[i] = 0;
+        lru->tail[i] = cache->assoc-1;
+    }
+    cache->repl = lru;
+}
 
-        // Instruction Fetch
-        int wayNum = searchCache(cache, state, state->pc);
-        int setNum = getSetOffset(state->pc);
-        int lineNum = state->pc%blockSize;
-        //printf("Line num: %d\n", lineNum);
-        /*for(int i =0; i<blockSize; i++)
-        {
-            printf("Address: %d\n", cache->cacheArray[setNum][wayNum].addresses[i]);
-        }*/
-        instr = cache->cacheArray[setNum][wayNum].addresses[lineNum];
-        //printf("Instruction: %d\n", instr);
-        //instr = state->mem[state->pc];
+//moves way to the head of its set's list in constant time
+void lruTouch(cacheType* cache, int setNum, int way)
+{
+    lruState* lru = (lruState*) cache->repl;
+    int base = setNum * cache->assoc;
+    int head = lru->head[setNum];
+    if(head == way)
+    {
+        return;
+    }
+    int prev = lru->prev[base + way];
+    int next = lru->next[base + way];
+    lru->next[base + prev] = next;
+    if(next == -1)
+    {
+        lru->tail[setNum] = prev;
+    }
+    else
+    {
+        lru->prev[base + next] = prev;
+    }
+    lru->prev[base + way] = -1;
+    lru->next[base + way] = head;
+    lru->prev[base + head] = way;
+    lru->head[setNum] = way;
+}
 
-        /* check for halt */
-        if (opcode(instr) == HALT) {
-            printf("machine halted\n");
-            break;
-        }
+int lruVictim(cacheType* cache, int setNum)
+{
+    return ((lruState*) cache->repl)->tail[setNum];
+}
 
-        // Increment the PC
-        state->pc = state->pc+1;
-
-        // Set reg A and B
-        regA = state->reg[field0(instr)];
-        regB = state->reg[field1(instr)];
-
-        // Set sign extended offset
-        offset = signExtend(field2(instr));
-
-        // Branch target gets set regardless of instruction
-        branchTarget = state->pc + offset;
-
-        /**
-         *
-         * Action depends on instruction
-         *
-         **/
-        //printInstruction(instr);
-        // ADD
-        if(opcode(instr) == ADD){
-            // Add
-            aluResult = regA + regB;
-            // Save result
-            state->reg[field2(instr)] = aluResult;
-        }
-            // NAND
-        else if(opcode(instr) == NAND){
-            // NAND
-            aluResult = ~(regA & regB);
-            // Save result
-            state->reg[field2(instr)] = aluResult;
-        }
-            // LW or SW
-        else if(opcode(instr) == LW || opcode(instr) == SW){
-            // Calculate memory address
-            aluResult = regB + offset;
-            int wayNum = searchCache(cache, state, aluResult);
-            if(opcode(instr) == LW){
-                // Load
-
-                state->reg[field0(instr)] = cacheToRegs(cache, state, aluResult, instr);
-               //cacheToRegs(cache, state, aluResult, instr);
-            }else if(opcode(instr) == SW){
-                // Store
-                //state->mem[aluResult] = regA;
-
-               regsToCache(cache, aluResult, state, regA);
-            }
-        }
-            // JALR
-        else if(opcode(instr) == JALR){
-            // Save pc+1 in regA
-            state->reg[field0(instr)] = state->pc;
-            //Jump to the address in regB;
-            state->pc = state->reg[field1(instr)];
-        }
-            // BEQ
-        else if(opcode(instr) == BEQ){
-            // Calculate condition
-            aluResult = (regA == regB);
-
-            // ZD
-            if(aluResult){
-                // branch
-                state->pc = branchTarget;
-            }
-        }
-    } // While
-    print_stats(total_instrs);
+void lruFree(cacheType* cache)
+{
+    lruState* lru = (lruState*) cache->repl;
+    free(lru->prev);
+    free(lru->next);
+    free(lru->head);
+    free(lru->tail);
+    free(lru);
 }
 
-int main(int argc, char** argv) {
+int lruArrays(cacheType* cache, void** ptrs, size_t* sizes)
+{
+    lruState* lru = (lruState*) cache->repl;
+    size_t numLines = (size_t)cache->geo.numSets * cache->assoc;
+    ptrs[0] = lru->prev;
+    sizes[0] = numLines * sizeof(int);
+    ptrs[1] = lru->next;
+    sizes[1] = numLines * sizeof(int);
+    ptrs[2] = lru->head;
+    sizes[2] = cache->geo.numSets * sizeof(int);
+    ptrs[3] = lru->tail;
+    sizes[3] = cache->geo.numSets * sizeof(int);
+    return 4;
+}
 
-    /** Get command line arguments **/
-    char *fname = (char *) malloc(sizeof(char) * 100);;
-    FILE *fp = (FILE *) malloc(sizeof(FILE));
+/*
+ * Tree-PLRU: assoc-1 bits per set laid out as a binary heap (node n has
+ * children 2n+1 and 2n+2). Each bit points at the half of its subtree that
+ * was used less recently. Needs a power-of-two associativity.
+ */
+typedef struct plruStateStruct {
+    unsigned char *bits; //one byte per node, assoc-1 nodes per set
+} plruState;
 
-    if (argc == 5) {
-        int strsize = strlen(argv[1]);
+void plruInit(cacheType* cache)
+{
+    plruState* plru = (plruState*) allocOrDie(1, sizeof(plruState));
+    plru->bits = (unsigned char*) allocOrDie((size_t)cache->geo.numSets * cache->assoc, 1);
+    cache->repl = plru;
+}
 
-        fname[0] = '\0';
+void plruTouch(cacheType* cache, int setNum, int way)
+{
+    unsigned char* bits = &((plruState*) cache->repl)->bits[setNum * cache->assoc];
+    int node = 0;
+    for(int half = cache->assoc / 2; half > 0; half /= 2)
+    {
+        bool right = (way & half) != 0;
+        bits[node] = !right; //point away from the way just used
+        node = 2 * node + (right ? 2 : 1);
+    }
+}
 
-        strcat(fname, argv[1]);
-        fp = fopen(fname, "r");
-        if (fp == NULL) {
-            printf("Cannot open file '%s' : %s\n", fname, strerror(errno));
-            return -1;
+int plruVictim(cacheType* cache, int setNum)
+{
+    unsigned char* bits = &((plruState*) cache->repl)->bits[setNum * cache->assoc];
+    int node = 0;
+    int way = 0;
+    for(int half = cache->assoc / 2; half > 0; half /= 2)
+    {
+        if(bits[node])
+        {
+            way |= half;
+            node = 2 * node + 2;
+        }
+        else
+        {
+            node = 2 * node + 1;
         }
+    }
+    return way;
+}
 
-        blockSize = atoi(argv[2]);
-        numbrSets = atoi(argv[3]);
-        associt = atoi(argv[4]);
-        // printf("%d, %d, %d\n", blockSize, numbrSets, associt);
+void plruFree(cacheType* cache)
+{
+    free(((plruState*) cache->repl)->bits);
+    free(cache->repl);
+}
 
-    } else {
-        //TODO error check the input
+int plruArrays(cacheType* cache, void** ptrs, size_t* sizes)
+{
+    ptrs[0] = ((plruState*) cache->repl)->bits;
+    sizes[0] = (size_t)cache->geo.numSets * cache->assoc;
+    return 1;
+}
 
-        //Takes in the parameters if they are not in the commnad line
+/*
+ * FIFO: a per-set pointer at the oldest way. Empty ways are filled from the
+ * top down, so the pointer starts at the top and walks down as well.
+ */
+typedef struct fifoStateStruct {
+    int *next;
+} fifoState;
 
+void fifoInit(cacheType* cache)
+{
+    fifoState* fifo = (fifoState*) allocOrDie(1, sizeof(fifoState));
+    fifo->next = (int*) allocOrDie(cache->geo.numSets, sizeof(int));
+    for(int i=0; i<cache->geo.numSets; i++)
+    {
+        fifo->next[i] = cache->assoc-1;
+    }
+    cache->repl = fifo;
+}
 
-        printf("\nEnter the machine code program to simulate: ");
-        fgets(fname, 100, stdin);
-        fname[strlen(fname) - 1] = '\0';
-        fp = fopen(fname, "r");
-        while (1) {
-            if (fp == NULL) {
-                printf("The file you entered does not exist. Please enter another one: ");
-                fgets(fname, 100, stdin);
-                fname[strlen(fname) - 1] = '\0';
-                fp = fopen(fname, "r");
-            } else {
-                break;
-            }
-        }
+int fifoVictim(cacheType* cache, int setNum)
+{
+    int* next = &((fifoState*) cache->repl)->next[setNum];
+    int way = *next;
+    *next = way == 0 ? cache->assoc-1 : way-1;
+    return way;
+}
 
-        printf("\nEnter the block size of the cache (in words): ");
-        scanf("%d", &blockSize);
-        while (blockSize > 256 || blockSize < 1) {
-            printf("\nThe block size you entered is not within the parameters (1-256). Please enter again: ");
-            scanf("%d", &blockSize);
-        }
+void fifoFree(cacheType* cache)
+{
+    free(((fifoState*) cache->repl)->next);
+    free(cache->repl);
+}
 
-        printf("\nEnter the number of sets in the cache (1 or greater): ");
-        scanf("%d", &numbrSets);
-        while (numbrSets < 1) {
-            printf("\nThe number you entered is not in the range (1 or greater). Please enter again: ");
-            scanf("%d", &numbrSets);
-        }
+int fifoArrays(cacheType* cache, void** ptrs, size_t* sizes)
+{
+    ptrs[0] = ((fifoState*) cache->repl)->next;
+    sizes[0] = cache->geo.numSets * sizeof(int);
+    return 1;
+}
 
-        printf("\nEnter the associativity of the cache (1 or greater): ");
-        scanf("%d", &associt);
-        while (associt < 1) {
-            printf("\nThe number you entered is not in the range (1 or greater). Please enter again: ");
-            scanf("%d", &associt);
-        }
-    }//else if
+//Random: no per-set state at all, just the cache's generator
+typedef struct randomStateStruct {
+    unsigned int rng;
+} randomState;
 
-    /* count the number of lines by counting newline characters */
-    int line_count = 0;
-    int c;
-    while (EOF != (c = getc(fp))) {
-        if (c == '\n') {
-            line_count++;
-        }
-    }
-    // reset fp to the beginning of the file
-    rewind(fp);
+void randomInit(cacheType* cache)
+{
+    randomState* rs = (randomState*) allocOrDie(1, sizeof(randomState));
+    rs->rng = randomSeed != 0 ? randomSeed : 1;
+    cache->repl = rs;
+}
 
-    stateType *state = (stateType *) malloc(sizeof(stateType));
+int randomVictim(cacheType* cache, int setNum)
+{
+    (void) setNum; //one generator serves every set
+    return nextRandom(&((randomState*) cache->repl)->rng) % cache->assoc;
+}
 
-    state->pc = 0;
-    memset(state->mem, 0, NUMMEMORY * sizeof(int));
-    memset(state->reg, 0, NUMREGS * sizeof(int));
+void randomFree(cacheType* cache)
+{
+    free(cache->repl);
+}
 
-    state->numMemory = line_count;
+int randomArrays(cacheType* cache, void** ptrs, size_t* sizes)
+{
+    ptrs[0] = &((randomState*) cache->repl)->rng;
+    sizes[0] = sizeof(unsigned int);
+    return 1;
+}
 
-    char line[256];
+//LFU: a use count per way, the victim is the lowest count (lowest way on a tie)
+typedef struct lfuStateStruct {
+    unsigned int *count;
+} lfuState;
 
-    int i = 0;
-    while (fgets(line, sizeof(line), fp)) {
-        /* note that fgets doesn't strip the terminating \n, checking its
-           presence would allow to handle lines longer that sizeof(line) */
-        state->mem[i] = atoi(line);
-        i++;
+void lfuInit(cacheType* cache)
+{
+    lfuState* lfu = (lfuState*) allocOrDie(1, sizeof(lfuState));
+    lfu->count = (unsigned int*) allocOrDie((size_t)cache->geo.numSets * cache->assoc,
+                                            sizeof(unsigned int));
+    cache->repl = lfu;
+}
+
+void lfuTouch(cacheType* cache, int setNum, int way)
+{
+    unsigned int* count = &((lfuState*) cache->repl)->count[setNum * cache->assoc + way];
+    if(*count != ~0u)
+    {
+        (*count)++;
     }
-    fclose(fp);
-    cacheType *cache = (cacheType *) malloc(sizeof(cacheType));
-    //printf("After block initialization\n");
+}
+
+void lfuFill(cacheType* cache, int setNum, int way)
+{
+    ((lfuState*) cache->repl)->count[setNum * cache->assoc + way] = 1;
+}
 
-    for (int i = 0; i < numbrSets; i++) {
-        //printf("first foor loop\n");
-        for (int j = 0; j < associt; j++) {
-            // printf("second for loop\n");
-            //printf("Tag at block %d: %d\n", i, cache->cacheArray[i][j].tag);
-            blockType temp = cache->cacheArray[i][j];
-            temp.tag = 0;
-            temp.dirty = 0;
-            temp.valid = 0;
-            cache->cacheArray[i][j] = temp;
+int lfuVictim(cacheType* cache, int setNum)
+{
+    unsigned int* count = &((lfuState*) cache->repl)->count[setNum * cache->assoc];
+    int victim = 0;
+    for(int i=1; i<cache->assoc; i++)
+    {
+        if(count[i] < count[victim])
+        {
+            victim = i;
         }
     }
+    return victim;
+}
 
+void lfuFree(cacheType* cache)
+{
+    free(((lfuState*) cache->repl)->count);
+    free(cache->repl);
+}
 
-    /** Run the simulation **/
-    //run(state);
+int lfuArrays(cacheType* cache, void** ptrs, size_t* sizes)
+{
+    ptrs[0] = ((lfuState*) cache->repl)->count;
+    sizes[0] = (size_t)cache->geo.numSets * cache->assoc * sizeof(unsigned int);
+    return 1;
+}
 
-    //printf("Way location: %d\n", searchCache(cacheArray, state, 9));
-    /*for(int i=0; i<associt; i++)
-    {
-        printf("Tag: %d\n", cache->cacheArray[i][0].tag);
-    }*/
-    //memToCache(cache, 9, state);
-    //searchCache(cache, state, 9);
-  // regsToCache(cache, 9, state, 3);
-    //cacheToMem(cache, 9, state);
-    run(state, cache);
+/*
+ * SRRIP and BRRIP (Jaleel et al.): a 2-bit re-reference prediction value per
+ * way. Hits predict a near re-reference (0), the victim is the first way
+ * predicting a distant one (RRPV_MAX), ageing the whole set until one does.
+ * SRRIP inserts at RRPV_MAX-1; BRRIP inserts at RRPV_MAX except for one fill
+ * in BRRIP_EPSILON, which makes it resistant to thrashing.
+ */
+#define RRPV_MAX 3
+#define BRRIP_EPSILON 32
 
+typedef struct rripStateStruct {
+    unsigned char *rrpv;
+    unsigned int rng;
+} rripState;
 
-    free(cache);
-    free(state);
+void rripInit(cacheType* cache)
+{
+    rripState* rrip = (rripState*) allocOrDie(1, sizeof(rripState));
+    int numLines = cache->geo.numSets * cache->assoc;
+    rrip->rrpv = (unsigned char*) allocOrDie(numLines, 1);
+    memset(rrip->rrpv, RRPV_MAX, numLines);
+    rrip->rng = randomSeed != 0 ? randomSeed : 1;
+    cache->repl = rrip;
+}
+
+void rripTouch(cacheType* cache, int setNum, int way)
+{
+    ((rripState*) cache->repl)->rrpv[setNum * cache->assoc + way] = 0;
+}
+
+void srripFill(cacheType* cache, int setNum, int way)
+{
+    ((rripState*) cache->repl)->rrpv[setNum * cache->assoc + way] = RRPV_MAX-1;
+}
+
+void brripFill(cacheType* cache, int setNum, int way)
+{
+    rripState* rrip = (rripState*) cache->repl;
+    bool nearInsert = nextRandom(&rrip->rng) % BRRIP_EPSILON == 0;
+    rrip->rrpv[setNum * cache->assoc + way] = nearInsert ? RRPV_MAX-1 : RRPV_MAX;
+}
+
+int rripVictim(cacheType* cache, int setNum)
+{
+    unsigned char* rrpv = &((rripState*) cache->repl)->rrpv[setNum * cache->assoc];
+    while(1)
+    {
+        for(int i=0; i<cache->assoc; i++)
+        {
+            if(rrpv[i] == RRPV_MAX)
+            {
+                return i;
+            }
+        }
+        for(int i=0; i<cache->assoc; i++)
+        {
+            rrpv[i]++;
+        }
+    }
+}
+
+void rripFree(cacheType* cache)
+{
+    free(((rripState*) cache->repl)->rrpv);
+    free(cache->repl);
+}
+
+int rripArrays(cacheType* cache, void** ptrs, size_t* sizes)
+{
+    rripState* rrip = (rripState*) cache->repl;
+    ptrs[0] = rrip->rrpv;
+    sizes[0] = (size_t)cache->geo.numSets * cache->assoc;
+    ptrs[1] = &rrip->rng;
+    sizes[1] = sizeof(unsigned int);
+    return 2;
+}
+
+/*
+ * Belady's OPT: evicts the block whose next use is furthest away. The whole
+ * access stream is known up front (oracleTrace), so a single backward pass
+ * turns it into nextUse[i], the position of the next access to the same
+ * block as access i. Every access ends in exactly one touch or fill, in
+ * program order, so a cursor into the stream tells each of them where it is
+ * and the way records when its block is wanted again.
+ */
+#define NEVER_USED INT_MAX
+
+typedef struct optStateStruct {
+    int *nextUse; //per access
+    int *wayNext; //per line, the next use of the block it holds
+    long cursor;
+} optState;
+
+void optInit(cacheType* cache)
+{
+    long length = oracleTrace.length;
+    if(length >= NEVER_USED)
+    {
+        printf("The opt policy can only replay runs of fewer than %d accesses\n", NEVER_USED);
+        exit(-1);
+    }
+    optState* opt = (optState*) allocOrDie(1, sizeof(optState));
+    opt->nextUse = (int*) allocOrDie(length, sizeof(int));
+    opt->wayNext = (int*) allocOrDie((size_t)cache->geo.numSets * cache->assoc, sizeof(int));
+    int numBlocks = NUMMEMORY / cache->geo.blockSize + 1;
+    int* lastSeen = (int*) allocOrDie(numBlocks, sizeof(int));
+    for(int i=0; i<numBlocks; i++)
+    {
+        lastSeen[i] = NEVER_USED;
+    }
+    for(long i=length-1; i>=0; i--)
+    {
+        int block = oracleTrace.addrs[i] / cache->geo.blockSize;
+        opt->nextUse[i] = lastSeen[block];
+        lastSeen[block] = (int) i;
+    }
+    free(lastSeen);
+    cache->repl = opt;
+}
+
+void optTouch(cacheType* cache, int setNum, int way)
+{
+    optState* opt = (optState*) cache->repl;
+    if(opt->cursor >= oracleTrace.length)
+    {
+        printf("The run has left the access stream the opt policy was built from\n");
+        exit(-1);
+    }
+    opt->wayNext[setNum * cache->assoc + way] = opt->nextUse[opt->cursor++];
+}
+
+int optVictim(cacheType* cache, int setNum)
+{
+    int* wayNext = &((optState*) cache->repl)->wayNext[setNum * cache->assoc];
+    int victim = 0;
+    for(int i=1; i<cache->assoc; i++)
+    {
+        if(wayNext[i] > wayNext[victim])
+        {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+void optFree(cacheType* cache)
+{
+    optState* opt = (optState*) cache->repl;
+    free(opt->nextUse);
+    free(opt->wayNext);
+    free(opt);
+}
+
+const replPolicy replPolicies[] = {
+    {"lru", lruInit, lruTouch, lruTouch, lruVictim, lruFree, false, false, lruArrays},
+    {"plru", plruInit, plruTouch, plruTouch, plruVictim, plruFree, false, true, plruArrays},
+    {"fifo", fifoInit, NULL, NULL, fifoVictim, fifoFree, false, false, fifoArrays},
+    {"random", randomInit, NULL, NULL, randomVictim, randomFree, false, false, randomArrays},
+    {"lfu", lfuInit, lfuTouch, lfuFill, lfuVictim, lfuFree, false, false, lfuArrays},
+    {"srrip", rripInit, rripTouch, srripFill, rripVictim, rripFree, false, false, rripArrays},
+    {"brrip", rripInit, rripTouch, brripFill, rripVictim, rripFree, false, false, rripArrays},
+    {"opt", optInit, optTouch, optTouch, optVictim, optFree, true, false, NULL},
+};
+
+//looks a policy up by name, NULL if there is no such policy
+const replPolicy* findPolicy(const char* name)
+{
+    for(size_t i=0; i<sizeof(replPolicies)/sizeof(replPolicies[0]); i++)
+    {
+        if(strcmp(replPolicies[i].name, name) == 0)
+        {
+            return &replPolicies[i];
+        }
+    }
+    return NULL;
+}
+
+cacheType* newCache(int blkSize, int numSets, int assoc, const replPolicy* policy)
+{
+    if(policy->pow2Ways && log2Exact(assoc) < 0)
+    {
+        printf("The %s policy needs a power of two associativity\n", policy->name);
+        exit(-1);
+    }
+    cacheType* cache = (cacheType*) allocOrDie(1, sizeof(cacheType));
+    int numLines = numSets * assoc;
+    cache->geo = makeGeometry(blkSize, numSets);
+    cache->findWay = selectFindWay(assoc);
+    cache->assoc = assoc;
+    cache->tags = (int*) allocOrDie(numLines, sizeof(int));
+    cache->valid = (unsigned char*) allocOrDie(numLines, sizeof(unsigned char));
+    cache->dirty = (unsigned char*) allocOrDie(numLines, sizeof(unsigned char));
+    cache->numValid = (int*) allocOrDie(numSets, sizeof(int));
+    cache->data = (int*) allocOrDie((size_t)numLines * blkSize, sizeof(int));
+    cache->policy = policy;
+    cache->writeAllocate = true;
+    cache->hitLatency = hitLatency;
+    cache->missLatency = missLatency;
+    policy->init(cache);
+    return cache;
+}
+
+/*
+ * Puts lower below upper in a hierarchy: upper's misses and writebacks go to
+ * lower instead of memory. Every level shares one inclusion policy.
+ */
+void linkLevels(cacheType* upper, cacheType* lower, enum inclusionType inclusion)
+{
+    upper->next = lower;
+    upper->inclusion = inclusion;
+    lower->inclusion = inclusion;
+    lower->uppers = (cacheType**) realloc(lower->uppers, (lower->numUppers + 1) * sizeof(cacheType*));
+    if(lower->uppers == NULL)
+    {
+        printf("Out of memory linking cache levels\n");
+        exit(-1);
+    }
+    lower->uppers[lower->numUppers++] = upper;
+}
+
+//gives the first level data cache the write policy from the command line
+void setWritePolicy(cacheType* cache)
+{
+    cache->writePolicy = writePolicy;
+    cache->writeAllocate = writeAllocate;
+    if(writePolicy == WRITE_THROUGH && writeBufferEntries > 0)
+    {
+        cache->writeBuffer = newWriteBuffer(writeBufferEntries, writeBufferDrain, cache->geo.blockSize);
+    }
+}
+
+void freeCache(cacheType* cache)
+{
+    cache->policy->destroy(cache);
+    if(cache->writeBuffer != NULL)
+    {
+        freeWriteBuffer(cache->writeBuffer);
+    }
+    if(cache->victims != NULL)
+    {
+        freeCache(cache->victims);
+    }
+    if(cache->prefetcher != NULL)
+    {
+        freePrefetcher(cache->prefetcher);
+    }
+    if(cache->mshrs != NULL)
+    {
+        freeMshrFile(cache->mshrs);
+    }
+    free(cache->coh);
+    free(cache->stolen);
+    free(cache->sectorValid);
+    free(cache->sectorDirty);
+    free(cache->wordUsed);
+    free(cache->uppers);
+    free(cache->tags);
+    free(cache->valid);
+    free(cache->dirty);
+    free(cache->numValid);
+    free(cache->data);
+    free(cache);
+}
+
+/**************** Timing *****************************/
+/*
+ * Every instruction takes its opcode's execution latency plus a first level
+ * hit for its fetch and, for loads and stores, its data access. Anything an
+ * access costs beyond that is a stall: the caches charge lower level hits,
+ * misses, memory reads and writes to whatever the core is currently waiting
+ * for. Work that happens in the background (prefetches, write buffer drains,
+ * the misses of a lockup-free cache) is charged to STALL_NONE, which nobody
+ * waits for.
+ */
+static ALWAYS_INLINE void chargeCycles(cacheType* cache, long long cycles)
+{
+    if(cache->timing != NULL)
+    {
+        cache->timing->stalls[cache->timing->cause] += cycles;
+    }
+}
+
+/*
+ * Charges what follows to cause and returns the cause to restore afterwards.
+ * Background work stays in the background, so nothing is redirected out of
+ * STALL_NONE.
+ */
+static ALWAYS_INLINE enum stallCause stallFor(cacheType* cache, enum stallCause cause)
+{
+    if(cache->timing == NULL)
+    {
+        return STALL_NONE;
+    }
+    enum stallCause old = cache->timing->cause;
+    if(old != STALL_NONE)
+    {
+        cache->timing->cause = cause;
+    }
+    return old;
+}
+
+static ALWAYS_INLINE void restoreStall(cacheType* cache, enum stallCause old)
+{
+    if(cache->timing != NULL)
+    {
+        cache->timing->cause = old;
+    }
+}
+
+long long totalCycles(const timingType* t)
+{
+    long long cycles = t->base;
+    for(int c=STALL_NONE+1; c<NUM_STALL_CAUSES; c++)
+    {
+        cycles += t->stalls[c];
+    }
+    return cycles;
+}
+
+//shares one timing record between every cache the run touches
+void attachTiming(cacheType* icache, cacheType* dcache, timingType* timing)
+{
+    timing->memoryLatency = memoryLatency;
+    timing->writeLatency = writeLatency;
+    icache->timing = timing;
+    for(cacheType* c = dcache; c != NULL; c = c->next)
+    {
+        c->timing = timing;
+        if(c->victims != NULL)
+        {
+            c->victims->timing = timing;
+        }
+    }
+}
+
+//writes the block held in line back to the level below, or memory at the bottom
+void cacheToMem(cacheType* cache, int line, stateType* state)
+{
+    int memStart = lineAddress(cache, line);
+    cache->writebacks++;
+    if(cache->bus != NULL)
+    {
+        cache->bus->writebacks++;
+    }
+    enum stallCause old = stallFor(cache, STALL_WRITEBACK);
+    if(cache->sectorDirty != NULL)
+    {
+        writeSectors(cache, line, memStart, state);
+    }
+    else
+    {
+        if(cache->numUppers == 0)
+        {
+            printAction(memStart, cache->geo.blockSize, cacheToMemory);
+        }
+        writeBelow(cache, state, memStart, &cache->data[line * cache->geo.blockSize], cache->geo.blockSize);
+    }
+    restoreStall(cache, old);
+    cache->dirty[line] = 0;
+}
+
+//returns the line holding aluResult and counts the hit, or -1 without filling anything
+static ALWAYS_INLINE int probeCache(cacheType* cache, int aluResult, bool pow2)
+{
+    int setNum = getSetOffset(&cache->geo, aluResult, pow2);
+    int tagNum = getTag(&cache->geo, aluResult, pow2);
+    int base = setNum * cache->assoc;
+    int way;
+    if(cache->assoc < SIMD_MIN_ASSOC)
+    {
+        way = findWayScalar(&cache->tags[base], &cache->valid[base], cache->assoc, tagNum);
+    }
+    else
+    {
+        way = cache->findWay(&cache->tags[base], &cache->valid[base], cache->assoc, tagNum);
+    }
+    if(way != -1 && cache->sectorValid != NULL &&
+       !cache->sectorValid[(base + way) * cache->numSectors +
+                           getBlockOffset(&cache->geo, aluResult, pow2) / cache->sectorSize])
+    {
+        //the block is here but not the sector, searchCache() fetches it
+        way = -1;
+    }
+    if(way != -1)
+    {
+        cache->hits++;
+        if(cache->numUppers > 0)
+        {
+            chargeCycles(cache, cache->hitLatency);
+        }
+        if(cache->prefetcher != NULL && cache->prefetcher->tagged[base + way])
+        {
+            usePrefetched(cache, base + way);
+        }
+        if(cache->mshrs != NULL)
+        {
+            mshrHit(cache, aluResult);
+        }
+        if(cache->policy->touch != NULL)
+        {
+            cache->policy->touch(cache, setNum, way);
+        }
+        return base + way;
+    }
+    return -1;
+}
+
+//returns the line holding aluResult, bringing the block in from memory on a miss
+static ALWAYS_INLINE int searchCache(cacheType* cache, stateType* state, int aluResult, bool pow2)
+{
+    int line = probeCache(cache, aluResult, pow2);
+    if(line >= 0)
+    {
+        return line;
+    }
+    if(cache->sectorValid != NULL)
+    {
+        return sectorMiss(cache, state, aluResult);
+    }
+    return memToCache(cache, state, getSetOffset(&cache->geo, aluResult, pow2),
+                      getTag(&cache->geo, aluResult, pow2), find_mem_start(&cache->geo, aluResult, pow2));
+}
+
+static ALWAYS_INLINE int cacheToRegs(cacheType* cache, stateType* state, int aluResult, bool pow2)
+{
+    int line = searchCache(cache, state, aluResult, pow2);
+    printAction(aluResult, 1, cacheToProcessor);
+    int lineNum = getBlockOffset(&cache->geo, aluResult, pow2);
+    if(cache->wordUsed != NULL)
+    {
+        cache->wordUsed[line * cache->geo.blockSize + lineNum] = 1;
+    }
+    return cache->data[line * cache->geo.blockSize + lineNum];
+}
+
+//prints a transfer only for the cache the processor talks to, lower levels are not part of the trace
+static void logTransfer(cacheType* cache, int address, int size, enum actionType type)
+{
+    if(cache->numUppers == 0)
+    {
+        printAction(address, size, type);
+    }
+}
+
+//finds the line holding aluResult without counting an access or touching the replacement state, or -1
+int lookupCache(cacheType* cache, int aluResult)
+{
+    bool pow2 = cache->geo.pow2;
+    int base = getSetOffset(&cache->geo, aluResult, pow2) * cache->assoc;
+    int way = cache->findWay(&cache->tags[base], &cache->valid[base], cache->assoc,
+                             getTag(&cache->geo, aluResult, pow2));
+    return way == -1 ? -1 : base + way;
+}
+
+//drops a line outside the normal replacement path (back-invalidation, exclusive moves)
+void invalidateLine(cacheType* cache, int line)
+{
+    untagLine(cache, line);
+    if(cache->coh != NULL)
+    {
+        cache->coh[line] = COH_I;
+    }
+    cache->valid[line] = 0;
+    cache->dirty[line] = 0;
+    cache->numValid[line / cache->assoc]--;
+}
+
+/*
+ * Picks the way a new block goes into and returns its line: the last invalid
+ * way while the set has one, after that the replacement policy's victim.
+ */
+int allocateLine(cacheType* cache, int setNum)
+{
+    int base = setNum * cache->assoc;
+    int wayNum;
+    if(cache->numValid[setNum] < cache->assoc)
+    {
+        wayNum = cache->assoc-1;
+        while(cache->valid[base + wayNum] == 1)
+        {
+            wayNum--;
+        }
+        cache->numValid[setNum]++;
+    }
+    else
+    {
+        wayNum = cache->policy->victim(cache, setNum);
+        untagLine(cache, base + wayNum);
+    }
+    return base + wayNum;
+}
+
+//copies count words starting at aluResult out of a lower level, filling it on a miss
+void readFromLevel(cacheType* lower, stateType* state, int aluResult, int* dst, int count)
+{
+    while(count > 0)
+    {
+        int line = searchCache(lower, state, aluResult, lower->geo.pow2);
+        int offset = getBlockOffset(&lower->geo, aluResult, lower->geo.pow2);
+        int words = lower->geo.blockSize - offset < count ? lower->geo.blockSize - offset : count;
+        memcpy(dst, &lower->data[line * lower->geo.blockSize + offset], words * sizeof(int));
+        aluResult += words;
+        dst += words;
+        count -= words;
+    }
+}
+
+//writes count words starting at aluResult into a lower level, allocating on a miss
+void writeToLevel(cacheType* lower, stateType* state, int aluResult, const int* src, int count)
+{
+    while(count > 0)
+    {
+        int line = searchCache(lower, state, aluResult, lower->geo.pow2);
+        int offset = getBlockOffset(&lower->geo, aluResult, lower->geo.pow2);
+        int words = lower->geo.blockSize - offset < count ? lower->geo.blockSize - offset : count;
+        memcpy(&lower->data[line * lower->geo.blockSize + offset], src, words * sizeof(int));
+        lower->dirty[line] = 1;
+        aluResult += words;
+        src += words;
+        count -= words;
+    }
+}
+
+/*
+ * Inclusive hierarchies: before a block leaves this level every copy of it in
+ * the levels above is invalidated. Dirty data found above is newer than ours,
+ * so it is merged into the line first and goes down with it.
+ */
+void backInvalidate(cacheType* cache, int line, stateType* state)
+{
+    int blockStart = lineAddress(cache, line);
+    for(int u=0; u<cache->numUppers; u++)
+    {
+        cacheType* upper = cache->uppers[u];
+        for(int addr = blockStart; addr < blockStart + cache->geo.blockSize; addr += upper->geo.blockSize)
+        {
+            int upperLine = lookupCache(upper, addr);
+            if(upperLine < 0)
+            {
+                continue;
+            }
+            if(upper->numUppers > 0)
+            {
+                backInvalidate(upper, upperLine, state);
+            }
+            if(upper->dirty[upperLine] == 1)
+            {
+                copyDirtyWords(upper, upperLine, 0, upper->geo.blockSize,
+                               &cache->data[line * cache->geo.blockSize + (addr - blockStart)]);
+                cache->dirty[line] = 1;
+            }
+            invalidateLine(upper, upperLine);
+            upper->backInvalidations++;
+        }
+    }
+}
+
+void insertBlock(cacheType* lower, stateType* state, int aluResult, const int* src, bool dirty);
+
+//sends the block held in line on its way out of the cache, the line itself is left for the caller
+void evictLine(cacheType* cache, int line, stateType* state)
+{
+    if(cache->inclusion == INCLUSIVE && cache->numUppers > 0)
+    {
+        backInvalidate(cache, line, state);
+    }
+    if(cache->inclusion == EXCLUSIVE && cache->next != NULL)
+    {
+        //exclusive levels keep every victim, clean or dirty, in the level below
+        int blockStart = lineAddress(cache, line);
+        bool dirty = cache->dirty[line] == 1;
+        logTransfer(cache, blockStart, cache->geo.blockSize, dirty ? cacheToMemory : cacheToNowhere);
+        if(dirty)
+        {
+            cache->writebacks++;
+            cache->writeWords += cache->geo.blockSize;
+        }
+        enum stallCause old = stallFor(cache, STALL_WRITEBACK);
+        chargeCycles(cache->next, cache->next->hitLatency);
+        restoreStall(cache, old);
+        insertBlock(cache->next, state, blockStart, &cache->data[line * cache->geo.blockSize], dirty);
+    }
+    else if(cache->dirty[line] == 1)
+    {
+        cacheToMem(cache, line, state);
+    }
+    else
+    {
+        logTransfer(cache, lineAddress(cache, line), cache->geo.blockSize, cacheToNowhere);
+    }
+}
+
+//places a block evicted from the level above into an exclusive level
+void insertBlock(cacheType* lower, stateType* state, int aluResult, const int* src, bool dirty)
+{
+    int line = lookupCache(lower, aluResult);
+    if(line < 0)
+    {
+        int setNum = getSetOffset(&lower->geo, aluResult, lower->geo.pow2);
+        line = allocateLine(lower, setNum);
+        if(lower->valid[line] == 1)
+        {
+            evictLine(lower, line, state);
+        }
+        lower->tags[line] = getTag(&lower->geo, aluResult, lower->geo.pow2);
+        lower->valid[line] = 1;
+        lower->dirty[line] = 0;
+        if(lower->policy->fill != NULL)
+        {
+            lower->policy->fill(lower, setNum, line - setNum * lower->assoc);
+        }
+    }
+    memcpy(&lower->data[line * lower->geo.blockSize], src, lower->geo.blockSize * sizeof(int));
+    if(dirty)
+    {
+        lower->dirty[line] = 1;
+    }
+}
+
+/*
+ * Brings the block starting at memStart into dst from wherever it lives below
+ * this cache. Returns true if the block arrives dirty, which only happens
+ * when an exclusive level hands over its only copy.
+ */
+bool fetchBlock(cacheType* cache, stateType* state, int memStart, int* dst)
+{
+    int words = cache->geo.blockSize;
+    cache->fillWords += words;
+    if(cache->next != NULL && cache->inclusion != EXCLUSIVE)
+    {
+        readFromLevel(cache->next, state, memStart, dst, words);
+        return false;
+    }
+    for(cacheType* lower = cache->next; lower != NULL; lower = lower->next)
+    {
+        int line = lookupCache(lower, memStart);
+        if(line >= 0)
+        {
+            bool dirty = lower->dirty[line] == 1;
+            lower->hits++;
+            chargeCycles(lower, lower->hitLatency);
+            memcpy(dst, &lower->data[line * words], words * sizeof(int));
+            invalidateLine(lower, line);
+            return dirty;
+        }
+        lower->misses++;
+        chargeCycles(lower, lower->missLatency);
+    }
+    if(cache->timing != NULL)
+    {
+        chargeCycles(cache, cache->timing->memoryLatency);
+    }
+    memcpy(dst, &state->mem[memStart], words * sizeof(int));
+    return false;
+}
+
+/*
+ * Split caches: the data cache may hold stores that have not reached the
+ * level below yet, so a block filled into the instruction cache picks up any
+ * dirty words its peer, or the peer's victim cache, has for it. The instruction cache itself is never
+ * written, so the data cache never needs the reverse.
+ */
+void snoopCache(cacheType* cache, int line, int memStart, cacheType* peer)
+{
+    int blockEnd = memStart + cache->geo.blockSize;
+    int addr = memStart - getBlockOffset(&peer->geo, memStart, peer->geo.pow2);
+    for(; addr < blockEnd; addr += peer->geo.blockSize)
+    {
+        int peerLine = lookupCache(peer, addr);
+        if(peerLine < 0 || peer->dirty[peerLine] == 0)
+        {
+            continue;
+        }
+        int from = addr < memStart ? memStart : addr;
+        int to = addr + peer->geo.blockSize < blockEnd ? addr + peer->geo.blockSize : blockEnd;
+        copyDirtyWords(peer, peerLine, from - addr, to - addr,
+                       &cache->data[line * cache->geo.blockSize + (from - memStart)]);
+    }
+}
+
+void snoopPeer(cacheType* cache, int line, int memStart)
+{
+    snoopCache(cache, line, memStart, cache->peer);
+    if(cache->peer->victims != NULL)
+    {
+        snoopCache(cache, line, memStart, cache->peer->victims);
+    }
+}
+
+/**************** Victim Cache *****************************/
+/*
+ * A small fully associative LRU cache beside the data cache that catches the
+ * blocks it evicts. A miss probes it before going below, and a hit swaps its
+ * block with the one the data cache is replacing. Blocks that fall out of it
+ * leave exactly as they would have left the data cache.
+ */
+void attachVictimCache(cacheType* cache, int entries)
+{
+    cache->victims = newCache(cache->geo.blockSize, 1, entries, findPolicy("lru"));
+    if(cache->next != NULL)
+    {
+        //inclusive levels below must be able to back-invalidate it like the cache itself
+        linkLevels(cache->victims, cache->next, cache->inclusion);
+    }
+}
+
+//moves the block in line into the victim cache, pushing the oldest victim out if it is full
+void moveToVictims(cacheType* cache, int line, stateType* state)
+{
+    cacheType* victims = cache->victims;
+    int words = cache->geo.blockSize;
+    int blockStart = lineAddress(cache, line);
+    int victimLine = allocateLine(victims, 0);
+    if(victims->valid[victimLine] == 1)
+    {
+        evictLine(victims, victimLine, state);
+    }
+    logTransfer(cache, blockStart, words, cacheToVictim);
+    memcpy(&victims->data[victimLine * words], &cache->data[line * words], words * sizeof(int));
+    victims->tags[victimLine] = getTag(&victims->geo, blockStart, victims->geo.pow2);
+    victims->valid[victimLine] = 1;
+    victims->dirty[victimLine] = cache->dirty[line];
+    victims->policy->fill(victims, 0, victimLine);
+}
+
+//swaps the block in victimLine with the one in line, which is about to hold tagNum
+void swapWithVictim(cacheType* cache, int line, int victimLine, int memStart)
+{
+    cacheType* victims = cache->victims;
+    int words = cache->geo.blockSize;
+    int* ours = &cache->data[line * words];
+    int* theirs = &victims->data[victimLine * words];
+    victims->hits++;
+    if(cache->valid[line] == 1)
+    {
+        int blockStart = lineAddress(cache, line);
+        logTransfer(cache, blockStart, words, cacheToVictim);
+        for(int i=0; i<words; i++)
+        {
+            int word = ours[i];
+            ours[i] = theirs[i];
+            theirs[i] = word;
+        }
+        unsigned char dirty = cache->dirty[line];
+        cache->dirty[line] = victims->dirty[victimLine];
+        victims->dirty[victimLine] = dirty;
+        victims->tags[victimLine] = getTag(&victims->geo, blockStart, victims->geo.pow2);
+        victims->policy->touch(victims, 0, victimLine);
+    }
+    else
+    {
+        memcpy(ours, theirs, words * sizeof(int));
+        cache->dirty[line] = victims->dirty[victimLine];
+        invalidateLine(victims, victimLine);
+    }
+    logTransfer(cache, memStart, words, victimToCache);
+}
+
+/**************** Sectors *****************************/
+/*
+ * With --sectors the first level data cache keeps one tag per block but a
+ * valid and a dirty bit per sector. A miss on the block allocates the line
+ * and brings in only the sector that was asked for. An access to a block
+ * that is present but without the right sector fetches just that sector, is
+ * counted as a miss and as a sector miss. A writeback sends down only the
+ * dirty sectors. Every word also has a used bit, so the words that were
+ * brought in and then never read or written before the line left can be
+ * reported as wasted fill bandwidth.
+ */
+void attachSectors(cacheType* cache, int sectors)
+{
+    int numLines = cache->geo.numSets * cache->assoc;
+    cache->numSectors = sectors;
+    cache->sectorSize = cache->geo.blockSize / sectors;
+    cache->sectorValid = (unsigned char*) allocOrDie(numLines * sectors, 1);
+    cache->sectorDirty = (unsigned char*) allocOrDie(numLines * sectors, 1);
+    cache->wordUsed = (unsigned char*) allocOrDie((size_t) numLines * cache->geo.blockSize, 1);
+}
+
+//the words of line that were filled but never used
+long long unusedWords(cacheType* cache, int line)
+{
+    long long unused = 0;
+    for(int w=0; w<cache->geo.blockSize; w++)
+    {
+        if(cache->sectorValid[line * cache->numSectors + w / cache->sectorSize] &&
+           !cache->wordUsed[line * cache->geo.blockSize + w])
+        {
+            unused++;
+        }
+    }
+    return unused;
+}
+
+//brings sector of the block starting at memStart into line
+void fetchSector(cacheType* cache, stateType* state, int line, int memStart, int sector)
+{
+    int words = cache->sectorSize;
+    int addr = memStart + sector * words;
+    int* dst = &cache->data[line * cache->geo.blockSize + sector * words];
+    logTransfer(cache, addr, words, memoryToCache);
+    if(cache->writeBuffer != NULL)
+    {
+        drainBufferedBlock(cache, state, addr, words);
+    }
+    if(cache->readOnly && cache->peer->writeBuffer != NULL)
+    {
+        drainBufferedBlock(cache->peer, state, addr, words);
+    }
+    cache->fillWords += words;
+    if(cache->next != NULL)
+    {
+        readFromLevel(cache->next, state, addr, dst, words);
+    }
+    else
+    {
+        if(cache->timing != NULL)
+        {
+            chargeCycles(cache, cache->timing->memoryLatency);
+        }
+        memcpy(dst, &state->mem[addr], words * sizeof(int));
+    }
+    cache->sectorValid[line * cache->numSectors + sector] = 1;
+}
+
+//a new block is going into line, it starts out with only the sector fillSector
+void fillSectors(cacheType* cache, stateType* state, int line, int memStart)
+{
+    memset(&cache->sectorValid[line * cache->numSectors], 0, cache->numSectors);
+    memset(&cache->sectorDirty[line * cache->numSectors], 0, cache->numSectors);
+    memset(&cache->wordUsed[line * cache->geo.blockSize], 0, cache->geo.blockSize);
+    fetchSector(cache, state, line, memStart, cache->fillSector);
+}
+
+//returns the line for aluResult after a probe found the block missing, or present without its sector
+int sectorMiss(cacheType* cache, stateType* state, int aluResult)
+{
+    bool pow2 = cache->geo.pow2;
+    int setNum = getSetOffset(&cache->geo, aluResult, pow2);
+    int memStart = find_mem_start(&cache->geo, aluResult, pow2);
+    int sector = getBlockOffset(&cache->geo, aluResult, pow2) / cache->sectorSize;
+    int line = lookupCache(cache, aluResult);
+    if(line < 0)
+    {
+        cache->fillSector = sector;
+        return memToCache(cache, state, setNum, getTag(&cache->geo, aluResult, pow2), memStart);
+    }
+    cache->misses++;
+    cache->sectorMisses++;
+    chargeCycles(cache, cache->missLatency);
+    fetchSector(cache, state, line, memStart, sector);
+    if(cache->policy->touch != NULL)
+    {
+        cache->policy->touch(cache, setNum, line - setNum * cache->assoc);
+    }
+    return line;
+}
+
+//writes the dirty sectors of line below
+void writeSectors(cacheType* cache, int line, int memStart, stateType* state)
+{
+    for(int s=0; s<cache->numSectors; s++)
+    {
+        if(!cache->sectorDirty[line * cache->numSectors + s])
+        {
+            continue;
+        }
+        int addr = memStart + s * cache->sectorSize;
+        if(cache->numUppers == 0)
+        {
+            printAction(addr, cache->sectorSize, cacheToMemory);
+        }
+        writeBelow(cache, state, addr, &cache->data[line * cache->geo.blockSize + s * cache->sectorSize],
+                   cache->sectorSize);
+        cache->sectorDirty[line * cache->numSectors + s] = 0;
+    }
+}
+
+/*
+ * Copies the words from..to (offsets into the block) of a dirty line into
+ * dst. A sectored line only has good data in its valid sectors, and only
+ * its dirty ones are newer than the levels below, so just those are copied.
+ */
+void copyDirtyWords(cacheType* cache, int line, int from, int to, int* dst)
+{
+    const int* src = &cache->data[line * cache->geo.blockSize];
+    if(cache->sectorDirty == NULL)
+    {
+        memcpy(dst, &src[from], (to - from) * sizeof(int));
+        return;
+    }
+    for(int w=from; w<to; w++)
+    {
+        if(cache->sectorDirty[line * cache->numSectors + w / cache->sectorSize])
+        {
+            dst[w - from] = src[w];
+        }
+    }
+}
+
+/**************** Prefetching *****************************/
+/*
+ * A prefetcher watches the data cache's loads and stores and brings in the
+ * blocks it expects them to want next. next-line and stride prefetch straight
+ * into the cache and tag the line until its first demand use. Stream buffers
+ * keep their blocks outside the cache until a miss claims one; a miss that
+ * no buffer holds restarts the least recently used buffer after it. A
+ * prefetch is late if its block is wanted within latency instructions of
+ * being issued, and unused if it is dropped before anyone asks for it.
+ */
+enum rptState{RPT_INITIAL, RPT_TRANSIENT, RPT_STEADY, RPT_NO_PRED};
+
+void attachPrefetcher(cacheType* cache, enum prefetchKind kind)
+{
+    prefetcherType* pf = (prefetcherType*) allocOrDie(1, sizeof(prefetcherType));
+    int numLines = cache->geo.numSets * cache->assoc;
+    pf->kind = kind;
+    pf->degree = prefetchDegree;
+    pf->distance = prefetchDistance;
+    pf->latency = prefetchLatency;
+    pf->tagged = (unsigned char*) allocOrDie(numLines, 1);
+    pf->issuedAt = (long long*) allocOrDie(numLines, sizeof(long long));
+    if(kind == PREFETCH_STRIDE)
+    {
+        pf->rpt = (rptEntry*) allocOrDie(RPT_ENTRIES, sizeof(rptEntry));
+    }
+    if(kind == PREFETCH_STREAM)
+    {
+        int numEntries = numStreamBuffers * pf->degree;
+        pf->numStreams = numStreamBuffers;
+        pf->streamCount = (int*) allocOrDie(numStreamBuffers, sizeof(int));
+        pf->streamNext = (int*) allocOrDie(numStreamBuffers, sizeof(int));
+        pf->streamUsed = (long long*) allocOrDie(numStreamBuffers, sizeof(long long));
+        pf->streamStart = (int*) allocOrDie(numEntries, sizeof(int));
+        pf->streamIssued = (long long*) allocOrDie(numEntries, sizeof(long long));
+        pf->streamData = (int*) allocOrDie((size_t)numEntries * cache->geo.blockSize, sizeof(int));
+    }
+    cache->prefetcher = pf;
+}
+
+void freePrefetcher(prefetcherType* pf)
+{
+    free(pf->tagged);
+    free(pf->issuedAt);
+    free(pf->rpt);
+    free(pf->streamCount);
+    free(pf->streamNext);
+    free(pf->streamUsed);
+    free(pf->streamStart);
+    free(pf->streamIssued);
+    free(pf->streamData);
+    free(pf);
+}
+
+//settles the counts of a line that is about to be dropped: an unused prefetch, or words filled but never used
+void untagLine(cacheType* cache, int line)
+{
+    if(cache->wordUsed != NULL)
+    {
+        cache->unusedWords += unusedWords(cache, line);
+    }
+    if(cache->prefetcher != NULL && cache->prefetcher->tagged[line])
+    {
+        cache->prefetcher->tagged[line] = 0;
+        cache->prefetcher->unused++;
+    }
+}
+
+//a demand access has hit a prefetched line for the first time
+void usePrefetched(cacheType* cache, int line)
+{
+    prefetcherType* pf = cache->prefetcher;
+    pf->tagged[line] = 0;
+    pf->useful++;
+    if(pf->now - pf->issuedAt[line] < pf->latency)
+    {
+        pf->late++;
+    }
+    pf->taggedHit = true;
+}
+
+//true if the block starting at memStart is inside memory and not already held by the cache or its victim cache
+static bool worthPrefetching(cacheType* cache, int memStart)
+{
+    return memStart >= 0 && memStart + cache->geo.blockSize <= NUMMEMORY &&
+           lookupCache(cache, memStart) < 0 &&
+           (cache->victims == NULL || lookupCache(cache->victims, memStart) < 0);
+}
+
+//prefetches the block holding addr into the cache unless it is already there
+void prefetchBlock(cacheType* cache, stateType* state, int addr)
+{
+    prefetcherType* pf = cache->prefetcher;
+    const geometryType* geo = &cache->geo;
+    if(addr < 0 || addr >= NUMMEMORY)
+    {
+        return;
+    }
+    int memStart = find_mem_start(geo, addr, geo->pow2);
+    if(!worthPrefetching(cache, memStart))
+    {
+        return;
+    }
+    int setNum = getSetOffset(geo, addr, geo->pow2);
+    int line = allocateLine(cache, setNum);
+    fillLine(cache, state, line, setNum, getTag(geo, addr, geo->pow2), memStart, memoryToPrefetch);
+    pf->tagged[line] = 1;
+    pf->issuedAt[line] = pf->now;
+    pf->issued++;
+}
+
+/*
+ * Chen and Baer's reference prediction table, indexed by the load or store's
+ * PC. An entry starts predicting once the same stride has been seen twice in
+ * a row; one wrong stride stops it but keeps the stride it had.
+ */
+void strideAccess(cacheType* cache, stateType* state, int pc, int aluResult)
+{
+    prefetcherType* pf = cache->prefetcher;
+    rptEntry* entry = &pf->rpt[pc % RPT_ENTRIES];
+    if(!entry->valid || entry->pc != pc)
+    {
+        entry->valid = true;
+        entry->pc = pc;
+        entry->lastAddr = aluResult;
+        entry->stride = 0;
+        entry->state = RPT_INITIAL;
+        return;
+    }
+    int stride = aluResult - entry->lastAddr;
+    bool correct = stride == entry->stride;
+    if(entry->state == RPT_INITIAL)
+    {
+        entry->state = correct ? RPT_STEADY : RPT_TRANSIENT;
+    }
+    else if(entry->state == RPT_STEADY)
+    {
+        entry->state = correct ? RPT_STEADY : RPT_INITIAL;
+        correct = true; //a steady entry keeps its stride through one miss
+    }
+    else if(entry->state == RPT_TRANSIENT)
+    {
+        entry->state = correct ? RPT_STEADY : RPT_NO_PRED;
+    }
+    else
+    {
+        entry->state = correct ? RPT_TRANSIENT : RPT_NO_PRED;
+    }
+    if(!correct)
+    {
+        entry->stride = stride;
+    }
+    entry->lastAddr = aluResult;
+    if(entry->state == RPT_STEADY && entry->stride != 0)
+    {
+        for(int k=0; k<pf->degree; k++)
+        {
+            prefetchBlock(cache, state, aluResult + entry->stride * (pf->distance + k));
+        }
+    }
+}
+
+/*
+ * Called after every load and store to the data cache. Next-line prefetching
+ * is tagged: a miss or the first use of a prefetched line fetches the next
+ * degree blocks, starting distance blocks on. The stride prefetcher's
+ * distance is counted in strides. Stream buffers do their work in fillLine.
+ */
+void prefetchAccess(cacheType* cache, stateType* state, int pc, int aluResult, bool missed)
+{
+    prefetcherType* pf = cache->prefetcher;
+    enum stallCause old = stallFor(cache, STALL_NONE);
+    if(pf->kind == PREFETCH_NEXT_LINE && (missed || pf->taggedHit))
+    {
+        int memStart = find_mem_start(&cache->geo, aluResult, cache->geo.pow2);
+        for(int k=0; k<pf->degree; k++)
+        {
+            prefetchBlock(cache, state, memStart + cache->geo.blockSize * (pf->distance + k));
+        }
+    }
+    else if(pf->kind == PREFETCH_STRIDE)
+    {
+        strideAccess(cache, state, pc, aluResult);
+    }
+    restoreStall(cache, old);
+}
+
+//tops stream s back up to degree blocks, following on from the last block it fetched
+void fillStream(cacheType* cache, stateType* state, int s)
+{
+    prefetcherType* pf = cache->prefetcher;
+    int words = cache->geo.blockSize;
+    for(int tries = pf->degree; tries > 0 && pf->streamCount[s] < pf->degree; tries--)
+    {
+        int memStart = pf->streamNext[s];
+        pf->streamNext[s] += words;
+        if(!worthPrefetching(cache, memStart))
+        {
+            continue;
+        }
+        int entry = s * pf->degree + pf->streamCount[s]++;
+        logTransfer(cache, memStart, words, memoryToStream);
+        if(cache->writeBuffer != NULL)
+        {
+            drainBufferedBlock(cache, state, memStart, words);
+        }
+        fetchBlock(cache, state, memStart, &pf->streamData[entry * words]);
+        pf->streamStart[entry] = memStart;
+        pf->streamIssued[entry] = pf->now;
+        pf->issued++;
+    }
+}
+
+//restarts the least recently used stream just after the block a miss went below for
+void allocateStream(cacheType* cache, stateType* state, int memStart)
+{
+    prefetcherType* pf = cache->prefetcher;
+    int s = 0;
+    for(int i=1; i<pf->numStreams; i++)
+    {
+        if(pf->streamUsed[i] < pf->streamUsed[s])
+        {
+            s = i;
+        }
+    }
+    for(int i=0; i<pf->streamCount[s]; i++)
+    {
+        if(pf->streamStart[s * pf->degree + i] >= 0)
+        {
+            pf->unused++;
+        }
+    }
+    pf->streamCount[s] = 0;
+    pf->streamNext[s] = memStart + cache->geo.blockSize * pf->distance;
+    pf->streamUsed[s] = pf->now;
+    fillStream(cache, state, s);
+}
+
+/*
+ * Looks for the block starting at memStart in every stream buffer. On a hit
+ * it is copied to dst, the entries ahead of it are dropped and the stream's
+ * number is returned for fillLine to refill it; otherwise -1.
+ */
+int takeFromStreams(cacheType* cache, int memStart, int* dst)
+{
+    prefetcherType* pf = cache->prefetcher;
+    int words = cache->geo.blockSize;
+    for(int s=0; s<pf->numStreams; s++)
+    {
+        int base = s * pf->degree;
+        for(int i=0; i<pf->streamCount[s]; i++)
+        {
+            if(pf->streamStart[base + i] != memStart)
+            {
+                continue;
+            }
+            memcpy(dst, &pf->streamData[(base + i) * words], words * sizeof(int));
+            pf->useful++;
+            if(pf->now - pf->streamIssued[base + i] < pf->latency)
+            {
+                pf->late++;
+            }
+            for(int j=0; j<i; j++)
+            {
+                if(pf->streamStart[base + j] >= 0)
+                {
+                    pf->unused++;
+                }
+            }
+            int left = pf->streamCount[s] - i - 1;
+            memmove(&pf->streamStart[base], &pf->streamStart[base + i + 1], left * sizeof(int));
+            memmove(&pf->streamIssued[base], &pf->streamIssued[base + i + 1], left * sizeof(long long));
+            memmove(&pf->streamData[base * words], &pf->streamData[(base + i + 1) * words],
+                    (size_t)left * words * sizeof(int));
+            pf->streamCount[s] = left;
+            pf->streamUsed[s] = pf->now;
+            return s;
+        }
+    }
+    return -1;
+}
+
+//drops every stream buffer entry a write to [memStart, memStart+count) below the cache has made stale
+void streamInvalidate(cacheType* cache, int memStart, int count)
+{
+    prefetcherType* pf = cache->prefetcher;
+    for(int s=0; s<pf->numStreams; s++)
+    {
+        for(int i=0; i<pf->streamCount[s]; i++)
+        {
+            int* start = &pf->streamStart[s * pf->degree + i];
+            if(*start >= 0 && *start < memStart + count && memStart < *start + cache->geo.blockSize)
+            {
+                *start = -1;
+                pf->unused++;
+            }
+        }
+    }
+}
+
+/**************** Miss Status Holding Registers *****************************/
+/*
+ * A lockup-free data cache keeps running while its misses are outstanding.
+ * Every fill it sends below takes an MSHR for latency cycles; a later access
+ * to a block that is still outstanding is a secondary miss and merges into
+ * its entry, and a miss that finds every MSHR busy stalls the core until the
+ * oldest one completes. Time is the timing model's cycle count, and the
+ * misses themselves cost the core nothing else.
+ */
+mshrFileType* newMshrFile(int numEntries, int latency)
+{
+    mshrFileType* m = (mshrFileType*) allocOrDie(1, sizeof(mshrFileType));
+    m->numEntries = numEntries;
+    m->latency = latency;
+    m->blockStart = (int*) allocOrDie(numEntries, sizeof(int));
+    m->readyAt = (long long*) allocOrDie(numEntries, sizeof(long long));
+    m->occupancy = (long long*) allocOrDie(numEntries + 1, sizeof(long long));
+    return m;
+}
+
+void freeMshrFile(mshrFileType* m)
+{
+    free(m->blockStart);
+    free(m->readyAt);
+    free(m->occupancy);
+    free(m);
+}
+
+//retires every entry that has completed by time t, adding up how long each number of entries was busy
+void mshrAdvance(mshrFileType* m, long long t)
+{
+    while(m->count > 0)
+    {
+        int oldest = 0;
+        for(int i=1; i<m->count; i++)
+        {
+            if(m->readyAt[i] < m->readyAt[oldest])
+            {
+                oldest = i;
+            }
+        }
+        if(m->readyAt[oldest] > t)
+        {
+            break;
+        }
+        m->occupancy[m->count] += m->readyAt[oldest] - m->lastEvent;
+        m->lastEvent = m->readyAt[oldest];
+        m->count--;
+        m->blockStart[oldest] = m->blockStart[m->count];
+        m->readyAt[oldest] = m->readyAt[m->count];
+    }
+    m->occupancy[m->count] += t - m->lastEvent;
+    m->lastEvent = t;
+}
+
+//the cache is sending a fill for the block starting at memStart below
+void mshrMiss(cacheType* cache, int memStart)
+{
+    mshrFileType* m = cache->mshrs;
+    mshrAdvance(m, m->now);
+    for(int i=0; i<m->count; i++)
+    {
+        if(m->blockStart[i] == memStart)
+        {
+            m->secondary++;
+            return;
+        }
+    }
+    if(m->count == m->numEntries)
+    {
+        long long oldest = m->readyAt[0];
+        for(int i=1; i<m->count; i++)
+        {
+            if(m->readyAt[i] < oldest)
+            {
+                oldest = m->readyAt[i];
+            }
+        }
+        m->fullStalls++;
+        m->stallCycles += oldest - m->now;
+        if(cache->timing != NULL)
+        {
+            //the core waits for this whatever else is going on
+            cache->timing->stalls[STALL_MSHR] += oldest - m->now;
+        }
+        m->now = oldest;
+        mshrAdvance(m, m->now);
+    }
+    m->blockStart[m->count] = memStart;
+    m->readyAt[m->count] = m->now + m->latency;
+    m->count++;
+    m->primary++;
+}
+
+//a hit on a block whose fill has not completed yet is a secondary miss, any other hit while misses are outstanding is a hit under miss
+void mshrHit(cacheType* cache, int aluResult)
+{
+    mshrFileType* m = cache->mshrs;
+    mshrAdvance(m, m->now);
+    if(m->count == 0)
+    {
+        return;
+    }
+    int memStart = find_mem_start(&cache->geo, aluResult, cache->geo.pow2);
+    for(int i=0; i<m->count; i++)
+    {
+        if(m->blockStart[i] == memStart)
+        {
+            m->secondary++;
+            return;
+        }
+    }
+    m->hitsUnderMiss++;
+}
+
+/**************** Coherence *****************************/
+/*
+ * Multicore runs give every core a private cache on a snooping bus. Each
+ * line carries a MESI or MOESI state. A read miss is a bus read: a copy in
+ * M, O or E elsewhere supplies the block (an intervention), M drops to S
+ * after writing back under MESI or to O without writing back under MOESI,
+ * and the reader gets E if nobody else has the block and S otherwise. A
+ * store miss is a bus read-exclusive and a store to an S or O line a bus
+ * upgrade; both invalidate every other copy. A miss on a block that another
+ * core's write invalidated here since we last had it is a coherence miss.
+ */
+#define BUS_LATENCY 10 /* cycles of a bus transaction that does not go to memory */
+
+busType* newBus(enum coherenceProtocol protocol)
+{
+    busType* bus = (busType*) allocOrDie(1, sizeof(busType));
+    bus->protocol = protocol;
+    return bus;
+}
+
+//puts a core's cache on the bus
+void joinBus(busType* bus, cacheType* cache)
+{
+    int numLines = cache->geo.numSets * cache->assoc;
+    bus->caches = (cacheType**) realloc(bus->caches, (bus->numCaches + 1) * sizeof(cacheType*));
+    if(bus->caches == NULL)
+    {
+        printf("Out of memory building the bus\n");
+        exit(-1);
+    }
+    bus->caches[bus->numCaches++] = cache;
+    cache->bus = bus;
+    cache->coh = (unsigned char*) allocOrDie(numLines, 1);
+    cache->stolen = (unsigned char*) allocOrDie(NUMMEMORY / cache->geo.blockSize + 1, 1);
+}
+
+void freeBus(busType* bus)
+{
+    free(bus->caches);
+    free(bus);
+}
+
+//drops another cache's copy because cache is about to write the block
+static void snoopInvalidate(cacheType* cache, cacheType* other, int line, int memStart)
+{
+    invalidateLine(other, line);
+    other->stolen[memStart / other->geo.blockSize] = 1;
+    cache->bus->invalidations++;
+}
+
+/*
+ * Brings the block starting at memStart into dst over the bus, from another
+ * cache if one owns it and from below otherwise, and returns the state the
+ * new line starts in. exclusive is set for store misses.
+ */
+enum cohState busFill(cacheType* cache, stateType* state, int memStart, int* dst, bool exclusive)
+{
+    busType* bus = cache->bus;
+    int words = cache->geo.blockSize;
+    bool supplied = false;
+    bool shared = false;
+    if(exclusive)
+    {
+        bus->readExclusives++;
+    }
+    else
+    {
+        bus->reads++;
+    }
+    if(cache->stolen[memStart / words])
+    {
+        cache->stolen[memStart / words] = 0;
+        cache->coherenceMisses++;
+    }
+    for(int c=0; c<bus->numCaches; c++)
+    {
+        cacheType* other = bus->caches[c];
+        int line = other == cache ? -1 : lookupCache(other, memStart);
+        if(line < 0)
+        {
+            continue;
+        }
+        enum cohState st = (enum cohState) other->coh[line];
+        if(!supplied && (st == COH_M || st == COH_O || st == COH_E))
+        {
+            memcpy(dst, &other->data[line * words], words * sizeof(int));
+            supplied = true;
+            bus->interventions++;
+        }
+        if(exclusive)
+        {
+            snoopInvalidate(cache, other, line, memStart);
+            continue;
+        }
+        shared = true;
+        if(st == COH_M && bus->protocol == MESI)
+        {
+            //the owner's flush is part of this transaction, not something its own core waits for
+            enum stallCause old = stallFor(other, STALL_NONE);
+            cacheToMem(other, line, state);
+            restoreStall(other, old);
+            other->coh[line] = COH_S;
+        }
+        else if(st == COH_M)
+        {
+            other->coh[line] = COH_O;
+        }
+        else if(st == COH_E)
+        {
+            other->coh[line] = COH_S;
+        }
+    }
+    if(supplied)
+    {
+        chargeCycles(cache, BUS_LATENCY);
+    }
+    else
+    {
+        fetchBlock(cache, state, memStart, dst);
+    }
+    if(exclusive)
+    {
+        return COH_M;
+    }
+    return shared ? COH_S : COH_E;
+}
+
+//a store is about to write line; anyone else holding the block loses it
+void busWrite(cacheType* cache, int line)
+{
+    enum cohState st = (enum cohState) cache->coh[line];
+    if(st == COH_S || st == COH_O)
+    {
+        busType* bus = cache->bus;
+        int memStart = lineAddress(cache, line);
+        bus->upgrades++;
+        chargeCycles(cache, BUS_LATENCY);
+        for(int c=0; c<bus->numCaches; c++)
+        {
+            cacheType* other = bus->caches[c];
+            int otherLine = other == cache ? -1 : lookupCache(other, memStart);
+            if(otherLine >= 0)
+            {
+                snoopInvalidate(cache, other, otherLine, memStart);
+            }
+        }
+    }
+    cache->coh[line] = COH_M;
+}
+
+/**************** Write Policies *****************************/
+/*
+ * A write-through data cache sends every store down through a small write
+ * buffer. Each entry holds one block's worth of words with a present flag
+ * per word, so stores to a block already waiting in the buffer coalesce into
+ * its entry. Entries leave oldest first, one every drainInterval
+ * instructions; a store that finds the buffer full stalls until the oldest
+ * entry has gone. A miss on a block that is still waiting drains the buffer
+ * up to it first so the fill sees the stored data.
+ */
+writeBufferType* newWriteBuffer(int numEntries, int drainInterval, int blkSize)
+{
+    writeBufferType* buffer = (writeBufferType*) allocOrDie(1, sizeof(writeBufferType));
+    buffer->numEntries = numEntries;
+    buffer->drainInterval = drainInterval;
+    buffer->blockStart = (int*) allocOrDie(numEntries, sizeof(int));
+    buffer->present = (unsigned char*) allocOrDie((size_t)numEntries * blkSize, 1);
+    buffer->data = (int*) allocOrDie((size_t)numEntries * blkSize, sizeof(int));
+    return buffer;
+}
+
+void freeWriteBuffer(writeBufferType* buffer)
+{
+    free(buffer->blockStart);
+    free(buffer->present);
+    free(buffer->data);
+    free(buffer);
+}
+
+//sends count words starting at aluResult to the level below the cache, or memory
+void writeBelow(cacheType* cache, stateType* state, int aluResult, const int* src, int count)
+{
+    if(cache->next != NULL)
+    {
+        writeToLevel(cache->next, state, aluResult, src, count);
+    }
+    else
+    {
+        if(cache->timing != NULL)
+        {
+            chargeCycles(cache, cache->timing->writeLatency);
+        }
+        memcpy(&state->mem[aluResult], src, count * sizeof(int));
+    }
+    cache->writeWords += count;
+    if(cache->prefetcher != NULL)
+    {
+        streamInvalidate(cache, aluResult, count);
+    }
+}
+
+//writes the oldest entry's words below, one transfer per run of present words
+void retireOldest(cacheType* cache, stateType* state)
+{
+    writeBufferType* buffer = cache->writeBuffer;
+    int words = cache->geo.blockSize;
+    int entry = buffer->head;
+    unsigned char* present = &buffer->present[entry * words];
+    int* data = &buffer->data[entry * words];
+    for(int i=0; i<words; i++)
+    {
+        if(!present[i])
+        {
+            continue;
+        }
+        int run = 1;
+        while(i + run < words && present[i + run])
+        {
+            run++;
+        }
+        logTransfer(cache, buffer->blockStart[entry] + i, run, cacheToMemory);
+        writeBelow(cache, state, buffer->blockStart[entry] + i, &data[i], run);
+        i += run - 1;
+    }
+    memset(present, 0, words);
+    buffer->head = (buffer->head + 1) % buffer->numEntries;
+    buffer->count--;
+    buffer->drains++;
+}
+
+//retires whatever would have drained on its own by instruction now
+void catchUpBuffer(cacheType* cache, stateType* state, long long now)
+{
+    writeBufferType* buffer = cache->writeBuffer;
+    enum stallCause old = stallFor(cache, STALL_NONE);
+    while(buffer->count > 0 && now - buffer->lastDrain >= buffer->drainInterval)
+    {
+        retireOldest(cache, state);
+        buffer->lastDrain += buffer->drainInterval;
+    }
+    restoreStall(cache, old);
+    if(buffer->count == 0)
+    {
+        buffer->lastDrain = now;
+    }
+}
+
+//queues a store of value to aluResult, merging it into a waiting entry for the same block if there is one
+void bufferStore(cacheType* cache, stateType* state, int aluResult, int value, long long now)
+{
+    writeBufferType* buffer = cache->writeBuffer;
+    int words = cache->geo.blockSize;
+    int offset = getBlockOffset(&cache->geo, aluResult, cache->geo.pow2);
+    int blockStart = aluResult - offset;
+    catchUpBuffer(cache, state, now);
+    if(cache->prefetcher != NULL)
+    {
+        streamInvalidate(cache, aluResult, 1);
+    }
+    for(int i=0; i<buffer->count; i++)
+    {
+        int entry = (buffer->head + i) % buffer->numEntries;
+        if(buffer->blockStart[entry] == blockStart)
+        {
+            buffer->present[entry * words + offset] = 1;
+            buffer->data[entry * words + offset] = value;
+            buffer->coalesced++;
+            return;
+        }
+    }
+    if(buffer->count == buffer->numEntries)
+    {
+        buffer->stalls++;
+        enum stallCause old = stallFor(cache, STALL_WRITE_BUFFER);
+        retireOldest(cache, state);
+        restoreStall(cache, old);
+        buffer->lastDrain = now;
+    }
+    int entry = (buffer->head + buffer->count) % buffer->numEntries;
+    buffer->blockStart[entry] = blockStart;
+    buffer->present[entry * words + offset] = 1;
+    buffer->data[entry * words + offset] = value;
+    buffer->count++;
+}
+
+//drains the buffer up to and including the newest entry that overlaps [memStart, memStart+count)
+void drainBufferedBlock(cacheType* cache, stateType* state, int memStart, int count)
+{
+    writeBufferType* buffer = cache->writeBuffer;
+    int last = -1;
+    for(int i=0; i<buffer->count; i++)
+    {
+        int start = buffer->blockStart[(buffer->head + i) % buffer->numEntries];
+        if(start < memStart + count && memStart < start + cache->geo.blockSize)
+        {
+            last = i;
+        }
+    }
+    enum stallCause old = stallFor(cache, STALL_WRITE_BUFFER);
+    for(int i=0; i<=last; i++)
+    {
+        retireOldest(cache, state);
+    }
+    restoreStall(cache, old);
+}
+
+/*
+ * Stores into the data cache. Write-back caches keep the word in the line and
+ * mark it dirty; write-through caches update the line if they have it and
+ * send the word down as well (through the write buffer when there is one).
+ * Without write-allocate a store miss leaves the cache alone and the word
+ * goes straight down.
+ */
+static ALWAYS_INLINE void regsToCache(cacheType* cache, int aluResult, stateType* state, int regA,
+                                      long long now, bool pow2)
+{
+    int line;
+    if(cache->writeAllocate)
+    {
+        cache->writeIntent = true;
+        line = searchCache(cache, state, aluResult, pow2);
+        cache->writeIntent = false;
+    }
+    else
+    {
+        line = probeCache(cache, aluResult, pow2);
+        if(line < 0 && cache->victims != NULL && lookupCache(cache->victims, aluResult) >= 0)
+        {
+            //the block is still in the victim cache, so it comes back as it would for a load
+            line = memToCache(cache, state, getSetOffset(&cache->geo, aluResult, pow2),
+                              getTag(&cache->geo, aluResult, pow2), find_mem_start(&cache->geo, aluResult, pow2));
+        }
+        else if(line < 0)
+        {
+            cache->misses++;
+            if(cache->victims != NULL)
+            {
+                cache->victims->misses++;
+            }
+        }
+    }
+    if(line >= 0 && cache->bus != NULL)
+    {
+        busWrite(cache, line);
+    }
+    int offset = getBlockOffset(&cache->geo, aluResult, pow2);
+    if(line >= 0)
+    {
+        printAction(aluResult, 1, processorToCache);
+        cache->data[line * cache->geo.blockSize + offset] = regA;
+        if(cache->wordUsed != NULL)
+        {
+            cache->wordUsed[line * cache->geo.blockSize + offset] = 1;
+        }
+    }
+    if(cache->writePolicy == WRITE_BACK && line >= 0)
+    {
+        cache->dirty[line] = 1;
+        if(cache->sectorDirty != NULL)
+        {
+            cache->sectorDirty[line * cache->numSectors + offset / cache->sectorSize] = 1;
+        }
+    }
+    else if(cache->writePolicy == WRITE_THROUGH && cache->writeBuffer != NULL)
+    {
+        bufferStore(cache, state, aluResult, regA, now);
+    }
+    else
+    {
+        printAction(aluResult, 1, processorToMemory);
+        writeBelow(cache, state, aluResult, &regA, 1);
+    }
+    if(cache->peer != NULL)
+    {
+        //the store makes any copy in the instruction cache stale
+        int peerLine = lookupCache(cache->peer, aluResult);
+        if(peerLine >= 0)
+        {
+            invalidateLine(cache->peer, peerLine);
+        }
+    }
+}
+
+/*
+ * Fills the block starting at memStart into set setNum and returns the line used.
+ * The block comes from the level below, or memory at the bottom of the
+ * hierarchy, and whatever it replaces is sent down first. The block data
+ * never moves once it is in a line.
+ */
+int memToCache(cacheType* cache, stateType* state, int setNum, int tagNum, int memStart)
+{
+    cache->misses++;
+    chargeCycles(cache, cache->missLatency);
+    int line = allocateLine(cache, setNum);
+    if(cache->victims != NULL)
+    {
+        int victimLine = lookupCache(cache->victims, memStart);
+        if(victimLine >= 0)
+        {
+            swapWithVictim(cache, line, victimLine, memStart);
+            cache->tags[line] = tagNum;
+            cache->valid[line] = 1;
+            if(cache->policy->fill != NULL)
+            {
+                cache->policy->fill(cache, setNum, line - setNum * cache->assoc);
+            }
+            return line;
+        }
+        cache->victims->misses++;
+    }
+    fillLine(cache, state, line, setNum, tagNum, memStart, memoryToCache);
+    return line;
+}
+
+/*
+ * Sends whatever line holds on its way and fills it with the block starting
+ * at memStart. type is memoryToCache for demand misses, which stream buffers
+ * get the first chance to satisfy, or memoryToPrefetch.
+ */
+void fillLine(cacheType* cache, stateType* state, int line, int setNum, int tagNum, int memStart,
+              enum actionType type)
+{
+    if(cache->valid[line] == 1)
+    {
+        if(cache->victims != NULL)
+        {
+            moveToVictims(cache, line, state);
+        }
+        else
+        {
+            evictLine(cache, line, state);
+        }
+        //keep the line out of reach of back-invalidations while the new block is fetched
+        cache->valid[line] = 0;
+    }
+
+    int* dst = &cache->data[line * cache->geo.blockSize];
+    if(cache->sectorValid != NULL)
+    {
+        fillSectors(cache, state, line, memStart);
+        cache->tags[line] = tagNum;
+        cache->valid[line] = 1;
+        cache->dirty[line] = 0;
+        if(cache->policy->fill != NULL)
+        {
+            cache->policy->fill(cache, setNum, line - setNum * cache->assoc);
+        }
+        return;
+    }
+    bool streams = type == memoryToCache && cache->prefetcher != NULL && cache->prefetcher->numStreams > 0;
+    int stream = streams ? takeFromStreams(cache, memStart, dst) : -1;
+    bool dirty = false;
+    if(stream >= 0)
+    {
+        logTransfer(cache, memStart, cache->geo.blockSize, streamToCache);
+    }
+    else
+    {
+        logTransfer(cache, memStart, cache->geo.blockSize, type);
+        if(cache->mshrs != NULL && type == memoryToCache)
+        {
+            mshrMiss(cache, memStart);
+        }
+        if(cache->writeBuffer != NULL)
+        {
+            drainBufferedBlock(cache, state, memStart, cache->geo.blockSize);
+        }
+        if(cache->readOnly && cache->peer->writeBuffer != NULL)
+        {
+            drainBufferedBlock(cache->peer, state, memStart, cache->geo.blockSize);
+        }
+        if(cache->bus != NULL)
+        {
+            cache->coh[line] = busFill(cache, state, memStart, dst, cache->writeIntent);
+        }
+        else
+        {
+            dirty = fetchBlock(cache, state, memStart, dst);
+        }
+        if(cache->readOnly)
+        {
+            snoopPeer(cache, line, memStart);
+        }
+    }
+    cache->tags[line] = tagNum;
+    cache->valid[line] = 1;
+    cache->dirty[line] = dirty;
+
+    if(cache->policy->fill != NULL)
+    {
+        cache->policy->fill(cache, setNum, line - setNum * cache->assoc);
+    }
+    if(streams)
+    {
+        //stream buffers fetch in the background
+        enum stallCause old = stallFor(cache, STALL_NONE);
+        if(stream >= 0)
+        {
+            fillStream(cache, state, stream);
+        }
+        else
+        {
+            allocateStream(cache, state, memStart);
+        }
+        restoreStall(cache, old);
+    }
+}
+
+/**************** Virtual Memory *****************************/
+/*
+ * With --vm every fetch, load and store address is virtual and is translated
+ * before the caches see it, so the caches hold physical blocks. The page
+ * table is a flat array with one entry per virtual page at the top of
+ * physical memory: (frame << 1) | 1 for a mapped page and 0 otherwise. The
+ * walker reads it through the data cache like any other load. Frames are
+ * handed out in the order pages are first touched. The page fault copies
+ * the page's part of the loaded program into its frame and stores the new
+ * entry through the data cache. The TLBs are caches of one-word blocks
+ * indexed by virtual page number, and each holds a frame number; one TLB
+ * serves fetches and data. A physically indexed (PIPT) cache waits for the
+ * TLB on every access. A virtually indexed one (VIPT) looks it up in
+ * parallel, which needs each way of the cache to fit inside a page.
+ */
+vmType* newVm(stateType* state, const replPolicy* tlbPolicy)
+{
+    vmType* vm = (vmType*) allocOrDie(1, sizeof(vmType));
+    vm->pageSize = vmPageSize;
+    vm->numPages = NUMMEMORY / vmPageSize;
+    vm->numFrames = vm->numPages - (vm->numPages + vmPageSize - 1) / vmPageSize;
+    vm->pageTable = vm->numFrames * vmPageSize;
+    vm->image = (int*) allocOrDie(NUMMEMORY, sizeof(int));
+    memcpy(vm->image, state->mem, NUMMEMORY * sizeof(int));
+    memset(state->mem, 0, sizeof(state->mem));
+    vm->vipt = viptIndexing;
+    vm->tlb = newCache(1, tlbGeometry[0], tlbGeometry[1], tlbPolicy);
+    vm->tlb->hitLatency = tlbGeometry[2];
+    if(tlb2Geometry[0] > 0)
+    {
+        vm->tlb2 = newCache(1, tlb2Geometry[0], tlb2Geometry[1], tlbPolicy);
+        vm->tlb2->hitLatency = tlb2Geometry[2];
+    }
+    return vm;
+}
+
+void freeVm(vmType* vm)
+{
+    freeCache(vm->tlb);
+    if(vm->tlb2 != NULL)
+    {
+        freeCache(vm->tlb2);
+    }
+    free(vm->image);
+    free(vm);
+}
+
+static void fillTlb(cacheType* tlb, int page, int frame)
+{
+    int setNum = getSetOffset(&tlb->geo, page, tlb->geo.pow2);
+    int line = allocateLine(tlb, setNum);
+    tlb->tags[line] = getTag(&tlb->geo, page, tlb->geo.pow2);
+    tlb->valid[line] = 1;
+    tlb->data[line] = frame;
+    if(tlb->policy->fill != NULL)
+    {
+        tlb->policy->fill(tlb, setNum, line - setNum * tlb->assoc);
+    }
+}
+
+//reads page's entry through the data cache and returns its frame, mapping the page first if it has none
+static int walkPageTable(cacheType* dcache, stateType* state, int page, long long now)
+{
+    vmType* vm = dcache->vm;
+    int entryAddr = vm->pageTable + page;
+    vm->walks++;
+    chargeCycles(dcache, dcache->hitLatency);
+    int entry = cacheToRegs(dcache, state, entryAddr, dcache->geo.pow2);
+    if(entry & 1)
+    {
+        return entry >> 1;
+    }
+    vm->faults++;
+    if(vm->nextFrame == vm->numFrames)
+    {
+        printf("Out of physical memory mapping page %d\n", page);
+        exit(-1);
+    }
+    int frame = vm->nextFrame++;
+    //nothing has touched the frame yet, so no cache holds a stale copy of it
+    memcpy(&state->mem[frame * vm->pageSize], &vm->image[page * vm->pageSize], vm->pageSize * sizeof(int));
+    regsToCache(dcache, entryAddr, state, (frame << 1) | 1, now, dcache->geo.pow2);
+    return frame;
+}
+
+//the physical address of vaddr
+static int translate(cacheType* dcache, stateType* state, int vaddr, long long now)
+{
+    vmType* vm = dcache->vm;
+    if(vaddr < 0 || vaddr >= NUMMEMORY)
+    {
+        printf("Address %d is outside of memory\n", vaddr);
+        exit(-1);
+    }
+    int page = vaddr / vm->pageSize;
+    int offset = vaddr % vm->pageSize;
+    if(!vm->vipt && dcache->timing != NULL)
+    {
+        dcache->timing->base += vm->tlb->hitLatency;
+    }
+    int line = probeCache(vm->tlb, page, vm->tlb->geo.pow2);
+    if(line >= 0)
+    {
+        return vm->tlb->data[line] * vm->pageSize + offset;
+    }
+    vm->tlb->misses++;
+    enum stallCause old = stallFor(dcache, STALL_TRANSLATION);
+    int frame = -1;
+    if(vm->tlb2 != NULL)
+    {
+        chargeCycles(dcache, vm->tlb2->hitLatency);
+        line = probeCache(vm->tlb2, page, vm->tlb2->geo.pow2);
+        if(line >= 0)
+        {
+            frame = vm->tlb2->data[line];
+        }
+        else
+        {
+            vm->tlb2->misses++;
+        }
+    }
+    if(frame < 0)
+    {
+        frame = walkPageTable(dcache, state, page, now);
+        if(vm->tlb2 != NULL)
+        {
+            fillTlb(vm->tlb2, page, frame);
+        }
+    }
+    fillTlb(vm->tlb, page, frame);
+    restoreStall(dcache, old);
+    return frame * vm->pageSize + offset;
+}
+
+/*
+ * The simulator loop is split into the steps every instruction takes, shared
+ * by the two dispatch engines below. pow2 is always a constant in the switch
+ * engine: runSlice() picks the copy specialized for the cache geometry once,
+ * so the address split inside the cache routines is resolved at compile
+ * time. *instrs is how many instructions have run so far; a run carries on
+ * until the program halts (returning true) or the count reaches limit.
+ */
+
+//stops the run once the pc has left memory, state->decoded only covers NUMMEMORY words
+static ALWAYS_INLINE void checkPc(int pc){
+    if((unsigned int) pc >= NUMMEMORY){ //negative pcs wrap to large ones
+        printf("The pc left memory: %d\n", pc);
+        exit(-1);
+    }
+}
+
+static ALWAYS_INLINE void recordAccess(accessRecorder* recorder, int addr, int flags){
+    accessRecord* record = &recorder->ring[recorder->count++ % recorder->length];
+    record->addr = addr;
+    record->flags = flags;
+}
+
+//fetches the instruction at the pc through the caches and returns its decoded form
+static ALWAYS_INLINE const decodedType* fetchInstr(stateType* state, cacheType* icache, cacheType* dcache,
+                                                   long long total_instrs, bool pow2){
+    checkPc(state->pc);
+    timingType* timing = dcache->timing;
+    if(dcache->recorder != NULL){
+        recordAccess(dcache->recorder, state->pc, TRACE_FETCH);
+    }
+    if(dcache->prefetcher != NULL){
+        dcache->prefetcher->now = total_instrs;
+    }
+    if(dcache->mshrs != NULL){
+        dcache->mshrs->now = timing != NULL ? totalCycles(timing) : total_instrs;
+    }
+    if(timing != NULL){
+        timing->cause = STALL_FETCH;
+    }
+    cacheToRegs(icache, state, dcache->vm != NULL ? translate(dcache, state, state->pc, total_instrs) : state->pc,
+                pow2);
+    const decodedType* instr = &state->decoded[state->pc];
+    if(timing != NULL){
+        timing->base += execLatency[instr->op & 0x7] + icache->hitLatency;
+    }
+    return instr;
+}
+
+//the pc has already moved past instr
+static ALWAYS_INLINE void loadStore(stateType* state, cacheType* dcache, const decodedType* instr,
+                                    long long total_instrs, bool pow2){
+    timingType* timing = dcache->timing;
+    int regA = state->reg[instr->regA];
+    // Calculate memory address
+    int aluResult = state->reg[instr->regB] + instr->offset;
+    int virtualAddr = aluResult;
+    if(dcache->vm != NULL){
+        aluResult = translate(dcache, state, aluResult, total_instrs);
+    }
+    if(dcache->recorder != NULL){
+        recordAccess(dcache->recorder, aluResult, instr->op == SW ? TRACE_WRITE : 0);
+    }
+    long long missesBefore = dcache->misses;
+    if(dcache->prefetcher != NULL){
+        dcache->prefetcher->taggedHit = false;
+    }
+    if(timing != NULL){
+        timing->base += dcache->hitLatency;
+        //a lockup-free cache's misses overlap with execution
+        timing->cause = dcache->mshrs != NULL ? STALL_NONE : instr->op == LW ? STALL_LOAD : STALL_STORE;
+        if(dcache->mshrs != NULL){
+            dcache->mshrs->now = totalCycles(timing);
+        }
+    }
+    if(instr->op == LW){
+        // Load
+        state->reg[instr->regA] = cacheToRegs(dcache, state, aluResult, pow2);
+    }else{
+        // Store, keeping the decoded copy of the word in step
+        regsToCache(dcache, aluResult, state, regA, total_instrs, pow2);
+        if(virtualAddr >= 0 && virtualAddr < NUMMEMORY){
+            state->decoded[virtualAddr] = decodeInstr(regA);
+        }
+    }
+    if(dcache->prefetcher != NULL){
+        prefetchAccess(dcache, state, state->pc - 1, aluResult, dcache->misses != missesBefore);
+    }
+}
+
+static void haltMachine(stateType* state, cacheType* dcache){
+    if (printTransfers) {
+        printf("machine halted\n");
+    }
+    if (dcache->timing != NULL) {
+        dcache->timing->cause = STALL_NONE;
+    }
+    //whatever is still in the write buffer reaches memory before the end
+    while (dcache->writeBuffer != NULL && dcache->writeBuffer->count > 0) {
+        retireOldest(dcache, state);
+    }
+    if (dcache->mshrs != NULL) {
+        mshrAdvance(dcache->mshrs, dcache->mshrs->now);
+    }
+}
+
+//the portable engine, one switch on the decoded opcode per instruction
+static ALWAYS_INLINE bool runLoop(stateType* state, cacheType* icache, cacheType* dcache, long long* instrs,
+                                  long long limit, bool pow2){
+    long long total_instrs = *instrs;
+    int* reg = state->reg;
+
+    // Primary loop
+    while(total_instrs < limit){
+        total_instrs++;
+        const decodedType* instr = fetchInstr(state, icache, dcache, total_instrs, pow2);
+        switch(instr->handler){
+        case ADD:
+            state->pc++;
+            reg[instr->dest] = reg[instr->regA] + reg[instr->regB];
+            break;
+        case NAND:
+            state->pc++;
+            reg[instr->dest] = ~(reg[instr->regA] & reg[instr->regB]);
+            break;
+        case LW:
+        case SW:
+            state->pc++;
+            loadStore(state, dcache, instr, total_instrs, pow2);
+            break;
+        case BEQ:
+            state->pc++;
+            if(reg[instr->regA] == reg[instr->regB]){
+                state->pc += instr->offset;
+            }
+            break;
+        case JALR:
+            state->pc++;
+            // Save pc+1 in regA, then jump to the address in regB
+            reg[instr->regA] = state->pc;
+            state->pc = reg[instr->regB];
+            break;
+        case HALT:
+            haltMachine(state, dcache);
+            *instrs = total_instrs;
+            return true;
+        default:
+            state->pc++;
+            break;
+        }
+    } // While
+    *instrs = total_instrs;
+    return false;
+}
+
+static bool runPow2(stateType* state, cacheType* icache, cacheType* dcache, long long* instrs, long long limit){
+    return runLoop(state, icache, dcache, instrs, limit, true);
+}
+
+static bool runGeneric(stateType* state, cacheType* icache, cacheType* dcache, long long* instrs, long long limit){
+    return runLoop(state, icache, dcache, instrs, limit, false);
+}
+
+#if HAVE_COMPUTED_GOTO
+/*
+ * The threaded engine: every handler ends with its own fetch and indirect
+ * jump to the next instruction's handler, picked by the handler index
+ * decodeInstr() resolved at load time, so the host predicts each jump from
+ * the instruction before it instead of funnelling everything through one
+ * switch. A function with computed gotos cannot be inlined or cloned, so
+ * there is only the copy for power of two geometries; the rest use the
+ * switch engine.
+ */
+static bool runThreaded(stateType* state, cacheType* icache, cacheType* dcache, long long* instrs,
+                        long long limit){
+    static void* const handlers[8] = {&&doAdd, &&doNand, &&doLoadStore, &&doLoadStore, &&doBeq, &&doJalr,
+                                      &&doHalt, &&doNoop};
+    long long total_instrs = *instrs;
+    int* reg = state->reg;
+    const decodedType* instr;
+
+#define DISPATCH() do { \
+        if(total_instrs >= limit){ \
+            goto done; \
+        } \
+        total_instrs++; \
+        instr = fetchInstr(state, icache, dcache, total_instrs, true); \
+        goto *handlers[instr->handler]; \
+    } while(0)
+
+    DISPATCH();
+doAdd:
+    state->pc++;
+    reg[instr->dest] = reg[instr->regA] + reg[instr->regB];
+    DISPATCH();
+doNand:
+    state->pc++;
+    reg[instr->dest] = ~(reg[instr->regA] & reg[instr->regB]);
+    DISPATCH();
+doLoadStore:
+    state->pc++;
+    loadStore(state, dcache, instr, total_instrs, true);
+    DISPATCH();
+doBeq:
+    state->pc++;
+    if(reg[instr->regA] == reg[instr->regB]){
+        state->pc += instr->offset;
+    }
+    DISPATCH();
+doJalr:
+    state->pc++;
+    reg[instr->regA] = state->pc;
+    state->pc = reg[instr->regB];
+    DISPATCH();
+doNoop:
+    state->pc++;
+    DISPATCH();
+doHalt:
+    haltMachine(state, dcache);
+    *instrs = total_instrs;
+    return true;
+done:
+    *instrs = total_instrs;
+    return false;
+#undef DISPATCH
+}
+#endif
+
+#if HAVE_JIT
+/*
+ * --jit translates basic blocks of the program into x86-64 code. A block
+ * runs from its first instruction up to a BEQ, JALR or HALT, or at most
+ * JIT_MAX_BLOCK instructions. Adds and nands become native code working on
+ * state->reg. Everything the caches see still goes through the same C
+ * routines run() uses, and in the same order: before each LW or SW, and at
+ * the end of the block, one call fetches every instruction since the
+ * previous call, so the transfer trace and statistics match the
+ * interpreter's exactly. The generated code keeps the state in rbx and the
+ * JIT context in r12. A block exit to a known pc starts out as a jump into
+ * a stub that returns to jitRun(); once the target has been translated, the
+ * jump is patched to go straight to it. A store into a word that belongs to
+ * a translated block leaves the block at once, and the whole code buffer is
+ * thrown away before anything else runs. Only runs to completion are
+ * translated; quantum-limited multicore slices stay on the interpreter.
+ */
+#define JIT_BUFFER_SIZE (8 << 20)
+#define JIT_MAX_BLOCK 64 /* instructions */
+#define JIT_MAX_BLOCK_BYTES (JIT_MAX_BLOCK * 64 + 256)
+
+typedef struct jitStruct {
+    stateType *state;
+    cacheType *icache;
+    cacheType *dcache;
+    long long instrs;
+    unsigned char *buffer;
+    size_t used;
+    unsigned char *epilogue;
+    int (*enter)(stateType*, struct jitStruct*, void*);
+    void **blockAt; //the code for the block starting at each pc, NULL if there is none yet
+    unsigned char *translated; //per word, part of some block
+    void *fetch; //jitFetchPow2() or jitFetchGeneric()
+    void *memory; //jitMemoryPow2() or jitMemoryGeneric()
+    unsigned char *exitSite; //the jump to patch after a chainable exit, NULL after any other
+    bool flush; //a store changed translated code
+    long long flushes; //code buffer resets, so jitRun() knows when a pending patch site is gone
+} jitType;
+
+//fetches the instructions from pc to last in order, as run() would one at a time
+static ALWAYS_INLINE void jitFetchRange(jitType* jit, int pc, int last, bool pow2)
+{
+    stateType* state = jit->state;
+    long long instrs = jit->instrs;
+    for (; pc <= last; pc++) {
+        state->pc = pc;
+        instrs++;
+        fetchInstr(state, jit->icache, jit->dcache, instrs, pow2);
+    }
+    jit->instrs = instrs;
+}
+
+static void jitFetchPow2(jitType* jit, int pc, int last)
+{
+    jitFetchRange(jit, pc, last, true);
+}
+
+static void jitFetchGeneric(jitType* jit, int pc, int last)
+{
+    jitFetchRange(jit, pc, last, false);
+}
+
+//fetches up to and including the LW or SW at pc and does its access, returns 1 if it wrote over translated code
+static ALWAYS_INLINE int jitMemory(jitType* jit, int first, int pc, bool pow2)
+{
+    jitFetchRange(jit, first, pc, pow2);
+    stateType* state = jit->state;
+    const decodedType* instr = &state->decoded[pc];
+    int addr = state->reg[instr->regB] + instr->offset;
+    state->pc = pc + 1;
+    loadStore(state, jit->dcache, instr, jit->instrs, pow2);
+    if (instr->op == SW && addr >= 0 && addr < NUMMEMORY && jit->translated[addr]) {
+        jit->flush = true;
+        return 1;
+    }
+    return 0;
+}
+
+static int jitMemoryPow2(jitType* jit, int first, int pc)
+{
+    return jitMemory(jit, first, pc, true);
+}
+
+static int jitMemoryGeneric(jitType* jit, int first, int pc)
+{
+    return jitMemory(jit, first, pc, false);
+}
+
+static void jitHalt(jitType* jit, int first, int pc)
+{
+    jitFetchGeneric(jit, first, pc);
+    haltMachine(jit->state, jit->dcache);
+}
+
+static void emit(jitType* jit, const void* bytes, size_t count)
+{
+    memcpy(jit->buffer + jit->used, bytes, count);
+    jit->used += count;
+}
+
+static void emitByte(jitType* jit, unsigned char b)
+{
+    jit->buffer[jit->used++] = b;
+}
+
+static void emit32(jitType* jit, int value)
+{
+    emit(jit, &value, 4);
+}
+
+//op eax, [rbx + disp] (or the other way round for a store), with op one of the 0x03 family of opcodes
+static void emitReg(jitType* jit, unsigned char opcode, int reg)
+{
+    emitByte(jit, opcode);
+    emitByte(jit, 0x83);
+    emit32(jit, (int) (offsetof(stateType, reg) + reg * sizeof(int)));
+}
+
+//a call to helper(jit, a, b)
+static void emitCall(jitType* jit, void* helper, int a, int b)
+{
+    static const unsigned char movRdiR12[] = {0x4c, 0x89, 0xe7};
+    emit(jit, movRdiR12, sizeof(movRdiR12));
+    emitByte(jit, 0xbe);
+    emit32(jit, a);
+    emitByte(jit, 0xba);
+    emit32(jit, b);
+    emitByte(jit, 0x48);
+    emitByte(jit, 0xb8);
+    emit(jit, &helper, 8);
+    emitByte(jit, 0xff);
+    emitByte(jit, 0xd0);
+}
+
+//jmp rel32 to target
+static void emitJump(jitType* jit, const unsigned char* target)
+{
+    emitByte(jit, 0xe9);
+    emit32(jit, (int) (target - (jit->buffer + jit->used + 4)));
+}
+
+//leaves for target, through a stub until jitRun() patches the jump to the target's own code
+static void emitExit(jitType* jit, int target)
+{
+    emitByte(jit, 0xe9);
+    unsigned char* site = jit->buffer + jit->used;
+    emit32(jit, 0);
+    //mov dword [rbx + pc], target
+    emitByte(jit, 0xc7);
+    emitByte(jit, 0x83);
+    emit32(jit, (int) offsetof(stateType, pc));
+    emit32(jit, target);
+    //mov rax, site; mov [r12 + exitSite], rax
+    emitByte(jit, 0x48);
+    emitByte(jit, 0xb8);
+    emit(jit, &site, 8);
+    static const unsigned char storeSite[] = {0x49, 0x89, 0x84, 0x24};
+    emit(jit, storeSite, sizeof(storeSite));
+    emit32(jit, (int) offsetof(jitType, exitSite));
+    //xor eax, eax
+    emitByte(jit, 0x31);
+    emitByte(jit, 0xc0);
+    emitJump(jit, jit->epilogue);
+}
+
+//the entry trampoline and the shared epilogue sit at the start of the buffer
+static void jitReset(jitType* jit)
+{
+    static const unsigned char entry[] = {
+        0x53,                   //push rbx
+        0x41, 0x54,             //push r12
+        0x48, 0x83, 0xec, 0x08, //sub rsp, 8
+        0x48, 0x89, 0xfb,       //mov rbx, rdi
+        0x49, 0x89, 0xf4,       //mov r12, rsi
+        0xff, 0xe2              //jmp rdx
+    };
+    static const unsigned char epilogue[] = {
+        0x48, 0x83, 0xc4, 0x08, //add rsp, 8
+        0x41, 0x5c,             //pop r12
+        0x5b,                   //pop rbx
+        0xc3                    //ret
+    };
+    jit->used = 0;
+    jit->enter = (int (*)(stateType*, jitType*, void*)) (void*) jit->buffer;
+    emit(jit, entry, sizeof(entry));
+    jit->epilogue = jit->buffer + jit->used;
+    emit(jit, epilogue, sizeof(epilogue));
+    memset(jit->blockAt, 0, NUMMEMORY * sizeof(void*));
+    memset(jit->translated, 0, NUMMEMORY);
+}
+
+static void* jitTranslate(jitType* jit, int start)
+{
+    if (jit->used + JIT_MAX_BLOCK_BYTES > JIT_BUFFER_SIZE) {
+        jit->flushes++;
+        jitReset(jit);
+    }
+    unsigned char* code = jit->buffer + jit->used;
+    jit->blockAt[start] = code;
+    int first = start;
+    for (int pc = start; ; pc++) {
+        const decodedType* instr = &jit->state->decoded[pc];
+        jit->translated[pc] = 1;
+        switch (instr->handler) {
+        case ADD:
+        case NAND:
+            emitReg(jit, 0x8b, instr->regA);
+            emitReg(jit, instr->handler == ADD ? 0x03 : 0x23, instr->regB);
+            if (instr->handler == NAND) {
+                emitByte(jit, 0xf7);
+                emitByte(jit, 0xd0);
+            }
+            emitReg(jit, 0x89, instr->dest);
+            break;
+        case LW:
+        case SW:
+            emitCall(jit, jit->memory, first, pc);
+            first = pc + 1;
+            if (instr->handler == SW) {
+                //test eax, eax; jz past the exit; xor eax, eax; jmp epilogue
+                static const unsigned char check[] = {0x85, 0xc0, 0x74, 0x07, 0x31, 0xc0};
+                emit(jit, check, sizeof(check));
+                emitJump(jit, jit->epilogue);
+            }
+            break;
+        case BEQ: {
+            emitCall(jit, jit->fetch, first, pc);
+            emitReg(jit, 0x8b, instr->regA);
+            emitReg(jit, 0x3b, instr->regB);
+            //jne to the fall-through exit, past the taken one
+            emitByte(jit, 0x0f);
+            emitByte(jit, 0x85);
+            unsigned char* skip = jit->buffer + jit->used;
+            emit32(jit, 0);
+            emitExit(jit, pc + 1 + instr->offset);
+            int rel = (int) (jit->buffer + jit->used - (skip + 4));
+            memcpy(skip, &rel, 4);
+            emitExit(jit, pc + 1);
+            return code;
+        }
+        case JALR:
+            emitCall(jit, jit->fetch, first, pc);
+            //mov dword [reg A], pc + 1; mov eax, [reg B]; mov [rbx + pc], eax
+            emitByte(jit, 0xc7);
+            emitByte(jit, 0x83);
+            emit32(jit, (int) (offsetof(stateType, reg) + instr->regA * sizeof(int)));
+            emit32(jit, pc + 1);
+            emitReg(jit, 0x8b, instr->regB);
+            emitByte(jit, 0x89);
+            emitByte(jit, 0x83);
+            emit32(jit, (int) offsetof(stateType, pc));
+            emitByte(jit, 0x31);
+            emitByte(jit, 0xc0);
+            emitJump(jit, jit->epilogue);
+            return code;
+        case HALT:
+            emitCall(jit, (void*) jitHalt, first, pc);
+            //mov eax, 1
+            emitByte(jit, 0xb8);
+            emit32(jit, 1);
+            emitJump(jit, jit->epilogue);
+            return code;
+        default:
+            break;
+        }
+        if (pc - start + 1 == JIT_MAX_BLOCK || pc + 1 == NUMMEMORY) {
+            emitCall(jit, jit->fetch, first, pc);
+            emitExit(jit, pc + 1);
+            return code;
+        }
+    }
+}
+
+static void* jitBlock(jitType* jit, int pc)
+{
+    checkPc(pc);
+    return jit->blockAt[pc] != NULL ? jit->blockAt[pc] : jitTranslate(jit, pc);
+}
+
+//runs the program to its halt on translated code, false if no executable memory could be had
+static bool jitRun(stateType* state, cacheType* icache, cacheType* dcache, long long* instrs)
+{
+    jitType jit;
+    memset(&jit, 0, sizeof(jit));
+    jit.buffer = (unsigned char*) mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit.buffer == MAP_FAILED) {
+        return false;
+    }
+    jit.state = state;
+    jit.icache = icache;
+    jit.dcache = dcache;
+    bool pow2 = icache->geo.pow2 && dcache->geo.pow2;
+    jit.fetch = pow2 ? (void*) jitFetchPow2 : (void*) jitFetchGeneric;
+    jit.memory = pow2 ? (void*) jitMemoryPow2 : (void*) jitMemoryGeneric;
+    jit.instrs = *instrs;
+    jit.blockAt = (void**) allocOrDie(NUMMEMORY, sizeof(void*));
+    jit.translated = (unsigned char*) allocOrDie(NUMMEMORY, 1);
+    jitReset(&jit);
+
+    void* code = jitBlock(&jit, state->pc);
+    for (;;) {
+        jit.exitSite = NULL;
+        if (jit.enter(state, &jit, code) != 0) {
+            break;
+        }
+        if (jit.flush) {
+            jit.flush = false;
+            jit.flushes++;
+            jitReset(&jit);
+        }
+        long long flushes = jit.flushes;
+        code = jitBlock(&jit, state->pc);
+        if (jit.exitSite != NULL && jit.flushes == flushes) {
+            int rel = (int) ((unsigned char*) code - (jit.exitSite + 4));
+            memcpy(jit.exitSite, &rel, 4);
+        }
+    }
+    *instrs = jit.instrs;
+    munmap(jit.buffer, JIT_BUFFER_SIZE);
+    free(jit.blockAt);
+    free(jit.translated);
+    return true;
+}
+#endif
+
+//runs until the program halts (true) or *instrs reaches limit (false)
+bool runSlice(stateType* state, cacheType* icache, cacheType* dcache, long long* instrs, long long limit){
+    bool pow2 = icache->geo.pow2 && dcache->geo.pow2;
+#if HAVE_JIT
+    if(dispatchMode == DISPATCH_JIT && limit == LLONG_MAX && jitRun(state, icache, dcache, instrs)){
+        return true;
+    }
+#endif
+#if HAVE_COMPUTED_GOTO
+    if(dispatchMode == DISPATCH_THREADED && pow2){
+        return runThreaded(state, icache, dcache, instrs, limit);
+    }
+#endif
+    if(pow2){
+        return runPow2(state, icache, dcache, instrs, limit);
+    }else{
+        return runGeneric(state, icache, dcache, instrs, limit);
+    }
+}
+
+/*
+ * Runs the program to its halt and returns how many instructions it executed.
+ * Fetches go to icache and loads and stores to dcache, which are the same
+ * cache unless the caches are split.
+ */
+long long run(stateType* state, cacheType* icache, cacheType* dcache){
+    long long instrs = 0;
+    runSlice(state, icache, dcache, &instrs, LLONG_MAX);
+    return instrs;
+}
+
+/**************** Multicore *****************************/
+/*
+ * --cores runs that many copies of the program on one shared memory. Each
+ * core has its own registers and PC, starting with its core number in
+ * register 7 so the copies can split up work, and its own cache on the
+ * coherence bus; any --level caches below are shared by every core. The
+ * cores take turns of coreQuantum instructions until all have halted.
+ *
+ * --parallel gives every core a host thread. In strict mode the threads
+ * pass a turn around in core order, so the result is exactly the serial
+ * one. In relaxed mode all cores run their quantum at once on their own
+ * caches, but only for as long as the next instruction hits privately and
+ * a store finds its line already M or E. An instruction that needs the bus
+ * or the shared levels instead marks its core as blocked and ends that
+ * core's quantum. Nothing else passes between the threads: the barrier
+ * orders the flag with everything else. Once every thread has reached the
+ * barrier, one of them runs the blocked instruction of each marked core in
+ * core order, bus transactions and shared levels included, so the relaxed
+ * schedule does not depend on host timing either; it just differs from the
+ * serial one.
+ */
+#define MAX_CORES 64
+
+struct multicoreStruct;
+
+typedef struct coreStruct {
+    int pc;
+    int reg[NUMREGS];
+    long long instructions;
+    bool halted;
+    cacheType *cache;
+    timingType timing;
+    int id;
+    pthread_t thread;
+    bool blocked; //relaxed: the next instruction needs the bus or the shared levels, run at the barrier
+    long long sharedRequests; //instructions run at the barrier for it
+    struct multicoreStruct *machine;
+} coreType;
+
+typedef struct multicoreStruct {
+    coreType *cores;
+    stateType *state; //the shared memory
+    int running; //cores that have not halted
+    long long quanta;
+    pthread_barrier_t barrier; //relaxed
+    pthread_mutex_t lock; //strict
+    pthread_cond_t turnChanged;
+    int turn; //the core whose quantum it is, -1 once all have halted
+} multicoreType;
+
+//runs a core on the shared memory until it halts or has done limit instructions
+static void runCore(multicoreType* machine, coreType* core, long long limit)
+{
+    stateType* state = machine->state;
+    state->pc = core->pc;
+    memcpy(state->reg, core->reg, sizeof(core->reg));
+    //the shared levels charge whichever core is running
+    attachTiming(core->cache, core->cache, &core->timing);
+    core->halted = runSlice(state, core->cache, core->cache, &core->instructions, limit);
+    core->pc = state->pc;
+    memcpy(core->reg, state->reg, sizeof(core->reg));
+}
+
+//whether the next instruction of the core in state can run on its own cache alone
+static bool runsPrivately(cacheType* cache, const stateType* state)
+{
+    checkPc(state->pc);
+    if (lookupCache(cache, state->pc) < 0) {
+        return false;
+    }
+    const decodedType* instr = &state->decoded[state->pc];
+    if (instr->op != LW && instr->op != SW) {
+        return true;
+    }
+    int line = lookupCache(cache, state->reg[instr->regB] + instr->offset);
+    if (line < 0) {
+        return false;
+    }
+    return instr->op == LW || cache->coh[line] == COH_M || cache->coh[line] == COH_E;
+}
+
+//one relaxed quantum of a core, on local, a private copy of its registers and pc
+static void runPrivately(coreType* core, stateType* local)
+{
+    local->pc = core->pc;
+    memcpy(local->reg, core->reg, sizeof(core->reg));
+    long long limit = core->instructions + coreQuantum;
+    while (core->instructions < limit) {
+        if (!runsPrivately(core->cache, local)) {
+            core->blocked = true;
+            break;
+        }
+        if (runSlice(local, core->cache, core->cache, &core->instructions, core->instructions + 1)) {
+            core->halted = true;
+            break;
+        }
+    }
+    core->pc = local->pc;
+    memcpy(core->reg, local->reg, sizeof(core->reg));
+}
+
+//between relaxed quanta, with every other thread waiting at the barrier
+static void serveBlocked(multicoreType* machine)
+{
+    machine->quanta++;
+    for (int c = 0; c < numCores; c++) {
+        coreType* core = &machine->cores[c];
+        if (core->blocked) {
+            core->blocked = false;
+            core->sharedRequests++;
+            runCore(machine, core, core->instructions + 1);
+        }
+    }
+    //counted only once every blocked core is served, cores halt in the private phase as well as here
+    machine->running = 0;
+    for (int c = 0; c < numCores; c++) {
+        machine->running += !machine->cores[c].halted;
+    }
+}
+
+static void* relaxedCoreMain(void* arg)
+{
+    coreType* core = (coreType*) arg;
+    multicoreType* machine = core->machine;
+    stateType* local = (stateType*) allocOrDie(1, sizeof(stateType));
+    //stores from the private phase only hit lines no other core holds, so sharing the table is safe
+    local->decoded = machine->state->decoded;
+    for (;;) {
+        if (!core->halted) {
+            runPrivately(core, local);
+        }
+        if (pthread_barrier_wait(&machine->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+            serveBlocked(machine);
+        }
+        pthread_barrier_wait(&machine->barrier);
+        if (machine->running == 0) {
+            break;
+        }
+    }
+    free(local);
+    return NULL;
+}
+
+//the core after c that has not halted, c itself if it is the only one left, or -1
+static int nextTurn(multicoreType* machine, int c)
+{
+    for (int i = 1; i <= numCores; i++) {
+        int next = (c + i) % numCores;
+        if (!machine->cores[next].halted) {
+            return next;
+        }
+    }
+    return -1;
+}
+
+static void* strictCoreMain(void* arg)
+{
+    coreType* core = (coreType*) arg;
+    multicoreType* machine = core->machine;
+    pthread_mutex_lock(&machine->lock);
+    while (!core->halted) {
+        while (machine->turn != core->id) {
+            pthread_cond_wait(&machine->turnChanged, &machine->lock);
+        }
+        runCore(machine, core, core->instructions + coreQuantum);
+        machine->running -= core->halted;
+        machine->turn = nextTurn(machine, core->id);
+        pthread_cond_broadcast(&machine->turnChanged);
+    }
+    pthread_mutex_unlock(&machine->lock);
+    return NULL;
+}
+
+static void runThreads(multicoreType* machine)
+{
+    void* (*coreMain)(void*) = parallelMode == PARALLEL_RELAXED ? relaxedCoreMain : strictCoreMain;
+    if (parallelMode == PARALLEL_RELAXED) {
+        //transfers from cores running at once would interleave arbitrarily
+        printTransfers = false;
+        pthread_barrier_init(&machine->barrier, NULL, numCores);
+    } else {
+        pthread_mutex_init(&machine->lock, NULL);
+        pthread_cond_init(&machine->turnChanged, NULL);
+        machine->turn = 0;
+    }
+    for (int c = 0; c < numCores; c++) {
+        if (pthread_create(&machine->cores[c].thread, NULL, coreMain, &machine->cores[c]) != 0) {
+            printf("Cannot start the thread of core %d\n", c);
+            exit(-1);
+        }
+    }
+    for (int c = 0; c < numCores; c++) {
+        pthread_join(machine->cores[c].thread, NULL);
+    }
+    if (parallelMode == PARALLEL_RELAXED) {
+        pthread_barrier_destroy(&machine->barrier);
+    } else {
+        pthread_mutex_destroy(&machine->lock);
+        pthread_cond_destroy(&machine->turnChanged);
+    }
+}
+
+int multicoreMain(stateType* state, const replPolicy* policy)
+{
+    multicoreType machine;
+    memset(&machine, 0, sizeof(machine));
+    machine.state = state;
+    machine.running = numCores;
+    machine.cores = (coreType*) allocOrDie(numCores, sizeof(coreType));
+    coreType* cores = machine.cores;
+    busType* bus = newBus(coherenceProtocol);
+    cacheType* shared = NULL;
+    cacheType* upper = NULL;
+    for (int l = 0; l < numLowerLevels; l++) {
+        cacheType* lower = newCache(lowerLevels[l][0], lowerLevels[l][1], lowerLevels[l][2], policy);
+        lower->hitLatency = lowerLevels[l][3];
+        if (upper != NULL) {
+            linkLevels(upper, lower, inclusionPolicy);
+        } else {
+            shared = lower;
+        }
+        upper = lower;
+    }
+    for (int c = 0; c < numCores; c++) {
+        cores[c].id = c;
+        cores[c].machine = &machine;
+        cores[c].cache = newCache(blockSize, numbrSets, associt, policy);
+        joinBus(bus, cores[c].cache);
+        if (shared != NULL) {
+            linkLevels(cores[c].cache, shared, inclusionPolicy);
+        }
+        attachTiming(cores[c].cache, cores[c].cache, &cores[c].timing);
+        cores[c].pc = state->pc;
+        memcpy(cores[c].reg, state->reg, sizeof(cores[c].reg));
+        cores[c].reg[7] = c;
+    }
+
+    if (parallelMode != PARALLEL_OFF) {
+        runThreads(&machine);
+    } else {
+        while (machine.running > 0) {
+            for (int c = 0; c < numCores; c++) {
+                if (!cores[c].halted) {
+                    runCore(&machine, &cores[c], cores[c].instructions + coreQuantum);
+                    machine.running -= cores[c].halted;
+                }
+            }
+        }
+    }
+
+    char name[32];
+    for (int c = 0; c < numCores; c++) {
+        snprintf(name, sizeof(name), "CORE %d ", c);
+        printf("%sINSTRUCTIONS: %lld\n", name, cores[c].instructions);
+        printTiming(name, cores[c].instructions, cores[c].cache, cores[c].cache);
+        printCacheStats(name, cores[c].cache);
+        if (parallelMode == PARALLEL_RELAXED) {
+            printf("%sSHARED REQUESTS: %lld\n", name, cores[c].sharedRequests);
+        }
+    }
+    int level = 2;
+    for (cacheType* c = shared; c != NULL; c = c->next, level++) {
+        snprintf(name, sizeof(name), "L%d ", level);
+        printCacheStats(name, c);
+    }
+    printf("BUS READS: %lld\n", bus->reads);
+    printf("BUS READ EXCLUSIVES: %lld\n", bus->readExclusives);
+    printf("BUS UPGRADES: %lld\n", bus->upgrades);
+    printf("BUS WRITEBACKS: %lld\n", bus->writebacks);
+    printf("INVALIDATIONS: %lld\n", bus->invalidations);
+    printf("INTERVENTIONS: %lld\n", bus->interventions);
+    if (parallelMode == PARALLEL_RELAXED) {
+        printf("QUANTA: %lld\n", machine.quanta);
+    }
+
+    for (int c = 0; c < numCores; c++) {
+        freeCache(cores[c].cache);
+    }
+    while (shared != NULL) {
+        cacheType* next = shared->next;
+        freeCache(shared);
+        shared = next;
+    }
+    freeBus(bus);
+    free(cores);
+    return 0;
+}
+
+/*
+ * Builds the single core cache hierarchy the command line describes and
+ * returns its first level data cache. *icache is set to the instruction
+ * cache, which is the same cache unless the caches are split.
+ */
+cacheType* newHierarchy(const replPolicy* policy, cacheType** icache)
+{
+    cacheType* cache = newCache(blockSize, numbrSets, associt, policy);
+    setWritePolicy(cache);
+    if (numSectors > 0) {
+        attachSectors(cache, numSectors);
+    }
+    *icache = cache;
+    if (splitCaches) {
+        *icache = newCache(icacheGeometry[0], icacheGeometry[1], icacheGeometry[2], policy);
+        (*icache)->readOnly = true;
+        (*icache)->peer = cache;
+        cache->peer = *icache;
+    }
+    cacheType* upper = cache;
+    for (int l = 0; l < numLowerLevels; l++) {
+        cacheType* lower = newCache(lowerLevels[l][0], lowerLevels[l][1], lowerLevels[l][2], policy);
+        lower->hitLatency = lowerLevels[l][3];
+        if (l == 0 && splitCaches) {
+            linkLevels(*icache, lower, inclusionPolicy);
+        }
+        linkLevels(upper, lower, inclusionPolicy);
+        upper = lower;
+    }
+    if (victimEntries > 0) {
+        attachVictimCache(cache, victimEntries);
+    }
+    if (prefetchKind != PREFETCH_NONE) {
+        attachPrefetcher(cache, prefetchKind);
+    }
+    if (numMshrs > 0) {
+        cache->mshrs = newMshrFile(numMshrs, mshrLatency);
+    }
+    return cache;
+}
+
+void freeHierarchy(cacheType* icache, cacheType* cache)
+{
+    if (icache != cache) {
+        freeCache(icache);
+    }
+    while (cache != NULL) {
+        cacheType* next = cache->next;
+        freeCache(cache);
+        cache = next;
+    }
+}
+
+/**************** Sampling *****************************/
+/*
+ * --sample u,w,p estimates CPI and miss rates by SMARTS style systematic
+ * sampling. The last u instructions of every period of p are measured in
+ * full detail, right after w instructions of detailed warming, and the rest
+ * are fast-forwarded. Fast-forwarding executes straight out of state->mem
+ * and only keeps the tags, valid and dirty bits and replacement state of
+ * every cache up to date (functional warming), so a measurement starts with
+ * warm caches. While it runs memory holds the only current copy of the
+ * data: dirty words are copied down into state->mem before it starts, and
+ * every valid line is reloaded from state->mem once it ends. The measured
+ * units give each estimate with a 95% confidence interval. If the CPI
+ * interval is wider than sampleError of the estimate, the program is run
+ * again with a period short enough for the variation seen, up to
+ * SAMPLE_MAX_PASSES passes in all.
+ */
+#define SAMPLE_MAX_PASSES 5
+#define SAMPLE_MIN_UNITS 30 /* units aimed for when a pass measured too few to go by */
+#define SAMPLE_Z 1.96 /* 95% confidence */
+
+static void warmAccess(cacheType* cache, stateType* state, int addr, bool write);
+
+//warms count words starting at addr in a lower level, the way readFromLevel() and writeToLevel() touch it
+static void warmRange(cacheType* lower, stateType* state, int addr, int count, bool write)
+{
+    int end = addr + count;
+    while(addr < end)
+    {
+        warmAccess(lower, state, addr, write);
+        addr += lower->geo.blockSize - getBlockOffset(&lower->geo, addr, lower->geo.pow2);
+    }
+}
+
+//the tag-only counterpart of fillLine() for the block holding addr
+static int warmFill(cacheType* cache, stateType* state, int addr)
+{
+    bool pow2 = cache->geo.pow2;
+    int setNum = getSetOffset(&cache->geo, addr, pow2);
+    int line = allocateLine(cache, setNum);
+    if(cache->valid[line] == 1)
+    {
+        if(cache->inclusion == INCLUSIVE && cache->numUppers > 0)
+        {
+            backInvalidate(cache, line, state);
+        }
+        if(cache->dirty[line] == 1 && cache->next != NULL)
+        {
+            warmRange(cache->next, state, lineAddress(cache, line), cache->geo.blockSize, true);
+        }
+        cache->valid[line] = 0;
+    }
+    if(cache->next != NULL)
+    {
+        warmRange(cache->next, state, find_mem_start(&cache->geo, addr, pow2), cache->geo.blockSize, false);
+    }
+    cache->tags[line] = getTag(&cache->geo, addr, pow2);
+    cache->valid[line] = 1;
+    cache->dirty[line] = 0;
+    if(cache->policy->fill != NULL)
+    {
+        cache->policy->fill(cache, setNum, line - setNum * cache->assoc);
+    }
+    return line;
+}
+
+//brings the replacement state of the hierarchy up to date for one access, without moving any data
+static void warmAccess(cacheType* cache, stateType* state, int addr, bool write)
+{
+    int line = lookupCache(cache, addr);
+    if(line >= 0)
+    {
+        if(cache->policy->touch != NULL)
+        {
+            cache->policy->touch(cache, line / cache->assoc, line % cache->assoc);
+        }
+    }
+    else if(!write || cache->writeAllocate)
+    {
+        line = warmFill(cache, state, addr);
+    }
+    if(!write)
+    {
+        return;
+    }
+    if(cache->writePolicy == WRITE_BACK && line >= 0)
+    {
+        cache->dirty[line] = 1;
+    }
+    else if(cache->writePolicy == WRITE_THROUGH && cache->next != NULL)
+    {
+        warmRange(cache->next, state, addr, 1, true);
+    }
+    if(cache->peer != NULL)
+    {
+        int peerLine = lookupCache(cache->peer, addr);
+        if(peerLine >= 0)
+        {
+            invalidateLine(cache->peer, peerLine);
+        }
+    }
+}
+
+//copies the dirty blocks of cache and the levels below it into memory, lowest level first so newer copies win
+static void writeDirtyLines(cacheType* cache, stateType* state)
+{
+    if(cache->next != NULL)
+    {
+        writeDirtyLines(cache->next, state);
+    }
+    int words = cache->geo.blockSize;
+    for(int line=0; line<cache->geo.numSets * cache->assoc; line++)
+    {
+        if(cache->valid[line] && cache->dirty[line])
+        {
+            memcpy(&state->mem[lineAddress(cache, line)], &cache->data[line * words], words * sizeof(int));
+        }
+    }
+}
+
+//refreshes the data of every valid line of cache and the levels below it from memory
+static void reloadLines(cacheType* cache, stateType* state)
+{
+    int words = cache->geo.blockSize;
+    for(int line=0; line<cache->geo.numSets * cache->assoc; line++)
+    {
+        if(cache->valid[line])
+        {
+            memcpy(&cache->data[line * words], &state->mem[lineAddress(cache, line)], words * sizeof(int));
+        }
+    }
+    if(cache->next != NULL)
+    {
+        reloadLines(cache->next, state);
+    }
+}
+
+//executes the instruction at the pc straight out of state->mem, returns false if it is a halt
+static ALWAYS_INLINE bool stepFunctional(stateType* state, const decodedType* instr){
+    int* reg = state->reg;
+    switch(instr->handler){
+    case ADD:
+        reg[instr->dest] = reg[instr->regA] + reg[instr->regB];
+        break;
+    case NAND:
+        reg[instr->dest] = ~(reg[instr->regA] & reg[instr->regB]);
+        break;
+    case LW:
+        reg[instr->regA] = state->mem[reg[instr->regB] + instr->offset];
+        break;
+    case SW: {
+        int addr = reg[instr->regB] + instr->offset;
+        state->mem[addr] = reg[instr->regA];
+        if(addr >= 0 && addr < NUMMEMORY){
+            state->decoded[addr] = decodeInstr(reg[instr->regA]);
+        }
+        break;
+    }
+    case BEQ:
+        if(reg[instr->regA] == reg[instr->regB]){
+            state->pc += instr->offset;
+        }
+        break;
+    case JALR:
+        reg[instr->regA] = state->pc + 1;
+        state->pc = reg[instr->regB] - 1;
+        break;
+    case HALT:
+        return false;
+    default:
+        break;
+    }
+    state->pc++;
+    //callers index state->decoded with the new pc straight away
+    checkPc(state->pc);
+    return true;
+}
+
+/*
+ * Runs functionally until the program halts (true) or *instrs reaches limit,
+ * warming the caches with every fetch, load and store on the way.
+ */
+static bool fastForward(stateType* state, cacheType* icache, cacheType* dcache, long long* instrs, long long limit){
+    long long total_instrs = *instrs;
+    bool halted = false;
+    if(total_instrs >= limit){
+        return false;
+    }
+    //memory has to be current before the program reads it directly
+    while(dcache->writeBuffer != NULL && dcache->writeBuffer->count > 0){
+        retireOldest(dcache, state);
+    }
+    writeDirtyLines(dcache, state);
+    while(total_instrs < limit && !halted){
+        total_instrs++;
+        warmAccess(icache, state, state->pc, false);
+        const decodedType* instr = &state->decoded[state->pc];
+        if(instr->handler == LW || instr->handler == SW){
+            warmAccess(dcache, state, state->reg[instr->regB] + instr->offset, instr->handler == SW);
+        }
+        halted = !stepFunctional(state, instr);
+    }
+    if(icache != dcache){
+        reloadLines(icache, state);
+    }
+    reloadLines(dcache, state);
+    *instrs = total_instrs;
+    return halted;
+}
+
+//running sums over the measured units of one pass
+typedef struct sampleSumsStruct {
+    long long units;
+    double cpi;
+    double cpiSquared;
+    int numCaches;
+    cacheType *caches[MAX_LEVELS + 2]; //in the order print_stats() prints them
+    char names[MAX_LEVELS + 2][8];
+    double misses[MAX_LEVELS + 2];
+    double accesses[MAX_LEVELS + 2];
+    double missesSquared[MAX_LEVELS + 2];
+    double accessesSquared[MAX_LEVELS + 2];
+    double product[MAX_LEVELS + 2]; //misses times accesses
+} sampleSums;
+
+static void listCaches(sampleSums* sums, cacheType* icache, cacheType* dcache)
+{
+    int n = 0;
+    if (icache == dcache && dcache->next == NULL) {
+        sums->caches[n] = dcache;
+        strcpy(sums->names[n++], "");
+    } else {
+        if (icache != dcache) {
+            sums->caches[n] = icache;
+            strcpy(sums->names[n++], "L1I ");
+            sums->caches[n] = dcache;
+            strcpy(sums->names[n++], "L1D ");
+        } else {
+            sums->caches[n] = dcache;
+            strcpy(sums->names[n++], "L1 ");
+        }
+        for (cacheType* c = dcache->next; c != NULL; c = c->next, n++) {
+            sums->caches[n] = c;
+            snprintf(sums->names[n], sizeof(sums->names[n]), "L%d ", n + (icache != dcache ? 0 : 1));
+        }
+    }
+    sums->numCaches = n;
+}
+
+/*
+ * Runs the whole program once with the given period, adding every complete
+ * measurement unit to sums, and returns how many instructions it executed.
+ */
+static long long samplePass(const stateType* image, const replPolicy* policy, long long period, sampleSums* sums)
+{
+    stateType* state = (stateType*) allocOrDie(1, sizeof(stateType));
+    memcpy(state, image, sizeof(stateType));
+    state->decoded = (decodedType*) allocOrDie(NUMMEMORY, sizeof(decodedType));
+    memcpy(state->decoded, image->decoded, NUMMEMORY * sizeof(decodedType));
+    cacheType* icache;
+    cacheType* cache = newHierarchy(policy, &icache);
+    timingType timing;
+    memset(&timing, 0, sizeof(timing));
+    attachTiming(icache, cache, &timing);
+    memset(sums, 0, sizeof(*sums));
+    listCaches(sums, icache, cache);
+
+    long long instrs = 0;
+    long long hits[MAX_LEVELS + 2];
+    long long misses[MAX_LEVELS + 2];
+    for (long long start = 0; ; start += period) {
+        long long measureFrom = start + period - sampleUnit;
+        if (fastForward(state, icache, cache, &instrs, measureFrom - sampleWarming) ||
+            runSlice(state, icache, cache, &instrs, measureFrom)) {
+            break;
+        }
+        long long cycles = totalCycles(&timing);
+        for (int c = 0; c < sums->numCaches; c++) {
+            hits[c] = sums->caches[c]->hits;
+            misses[c] = sums->caches[c]->misses;
+        }
+        bool halted = runSlice(state, icache, cache, &instrs, start + period);
+        if (instrs < start + period) {
+            //the program halted before the unit was complete
+            break;
+        }
+        double cpi = (double) (totalCycles(&timing) - cycles) / sampleUnit;
+        sums->units++;
+        sums->cpi += cpi;
+        sums->cpiSquared += cpi * cpi;
+        for (int c = 0; c < sums->numCaches; c++) {
+            double m = (double) (sums->caches[c]->misses - misses[c]);
+            double a = m + (double) (sums->caches[c]->hits - hits[c]);
+            sums->misses[c] += m;
+            sums->accesses[c] += a;
+            sums->missesSquared[c] += m * m;
+            sums->accessesSquared[c] += a * a;
+            sums->product[c] += m * a;
+        }
+        if (halted) {
+            break;
+        }
+    }
+    freeHierarchy(icache, cache);
+    freeState(state);
+    return instrs;
+}
+
+//the mean CPI of the units and the half width of its confidence interval
+static double sampleCpi(const sampleSums* sums, double* halfWidth)
+{
+    double n = (double) sums->units;
+    double mean = sums->cpi / n;
+    double variance = n > 1 ? (sums->cpiSquared - n * mean * mean) / (n - 1) : 0.0;
+    *halfWidth = SAMPLE_Z * sqrt(variance > 0 ? variance / n : 0.0);
+    return mean;
+}
+
+//the ratio estimate of cache c's miss rate and the half width of its confidence interval
+static double sampleMissRate(const sampleSums* sums, int c, double* halfWidth)
+{
+    double n = (double) sums->units;
+    if (sums->accesses[c] == 0) {
+        *halfWidth = 0.0;
+        return 0.0;
+    }
+    double rate = sums->misses[c] / sums->accesses[c];
+    double meanAccesses = sums->accesses[c] / n;
+    //the variance of misses - rate * accesses over the units
+    double residual = (sums->missesSquared[c] - 2 * rate * sums->product[c] +
+                       rate * rate * sums->accessesSquared[c]) / (n - 1);
+    *halfWidth = SAMPLE_Z * sqrt(residual > 0 ? residual / n : 0.0) / meanAccesses;
+    return rate;
+}
+
+int samplingMain(stateType* state, const replPolicy* policy)
+{
+    //the transfer trace of scattered units would be meaningless
+    printTransfers = false;
+    long long period = samplePeriod;
+    long long minPeriod = sampleUnit + sampleWarming;
+    sampleSums sums;
+    long long instrs = 0;
+    for (int pass = 1; ; pass++) {
+        instrs = samplePass(state, policy, period, &sums);
+        double halfWidth = 0.0;
+        double cpi = sums.units > 1 ? sampleCpi(&sums, &halfWidth) : 0.0;
+        double error = cpi > 0 ? halfWidth / cpi : 0.0;
+        printf("SAMPLING PASS %d: PERIOD %lld, UNITS %lld", pass, period, sums.units);
+        if (sums.units > 1) {
+            printf(", CPI ERROR %.4f%%", 100.0 * error);
+        }
+        printf("\n");
+        bool enough = sums.units > 1 && error <= sampleError / 100.0;
+        if (enough || pass == SAMPLE_MAX_PASSES || period == minPeriod) {
+            break;
+        }
+        //SMARTS: n = (z * V / e)^2 units for a coefficient of variation V and relative error e
+        long long needed = SAMPLE_MIN_UNITS;
+        if (sums.units > 1) {
+            double cv = halfWidth / SAMPLE_Z * sqrt((double) sums.units) / cpi;
+            needed = (long long) ceil(pow(SAMPLE_Z * cv / (sampleError / 100.0), 2));
+        }
+        long long next = needed > 0 ? instrs / needed : period;
+        if (next >= period) {
+            next = period / 2;
+        }
+        period = next < minPeriod ? minPeriod : next;
+    }
+    if (sums.units < 2) {
+        printf("The program is too short for two measurement units, shorten --sample's unit or warming\n");
+        return -1;
+    }
+    double halfWidth;
+    double cpi = sampleCpi(&sums, &halfWidth);
+    printf("INSTRUCTIONS: %lld\n", instrs);
+    printf("SAMPLED UNITS: %lld\n", sums.units);
+    printf("DETAILED INSTRUCTIONS: %lld\n", sums.units * minPeriod);
+    printf("CPI: %.4f +- %.4f\n", cpi, halfWidth);
+    printf("CYCLES: %.0f +- %.0f\n", cpi * instrs, halfWidth * instrs);
+    for (int c = 0; c < sums.numCaches; c++) {
+        double rate = sampleMissRate(&sums, c, &halfWidth);
+        printf("%sMISS RATE: %.4f%% +- %.4f%%\n", sums.names[c], 100.0 * rate, 100.0 * halfWidth);
+    }
+    return 0;
+}
+
+/**************** SimPoint *****************************/
+/*
+ * --simpoint-profile runs the program functionally and cuts it into
+ * intervals of simpointInterval instructions. Each interval gets a basic
+ * block vector: for every basic block (named by the pc it starts at) the
+ * share of the interval's instructions it executed. The vectors are
+ * randomly projected down to SIMPOINT_DIMS dimensions and clustered with
+ * k-means for every k up to simpointMaxK. The smallest k whose BIC score
+ * reaches 90% of the best one wins, as in SimPoint. The interval nearest
+ * each cluster's centre represents it, weighted by the share of all
+ * instructions its cluster executed, and the list goes to a file.
+ *
+ * --simpoint-replay reads that file back. One functional pass takes a
+ * checkpoint of the architectural state simpointWarming instructions before
+ * each representative interval. Each checkpoint is then simulated in detail
+ * with a fresh hierarchy: the warming instructions first, then the interval
+ * itself, which is measured. The weighted per-instruction rates give the
+ * whole program estimates.
+ */
+#define SIMPOINT_DIMS 15 /* dimensions of the projected vectors */
+#define SIMPOINT_ITERATIONS 100 /* most k-means rounds per k */
+
+//the projection matrix entry for block pc and dimension d, uniform in [-1, 1], made up on the fly
+static double projectionWeight(int pc, int d)
+{
+    unsigned int rng = ((unsigned int) (pc * SIMPOINT_DIMS + d) + 1) * 2654435761u ^ randomSeed;
+    rng = rng != 0 ? rng : 1;
+    nextRandom(&rng);
+    return (double) nextRandom(&rng) / UINT_MAX * 2.0 - 1.0;
+}
+
+//the projected basic block vectors of a profiling run, one row of SIMPOINT_DIMS per interval
+typedef struct bbvStruct {
+    double *rows;
+    long long *lengths; //instructions in each interval, only the last one may be short
+    int count;
+    int capacity;
+} bbvType;
+
+static void addInterval(bbvType* bbv, const double* row, long long length)
+{
+    if (bbv->count == bbv->capacity) {
+        bbv->capacity = bbv->capacity ? bbv->capacity * 2 : 64;
+        bbv->rows = (double*) realloc(bbv->rows, (size_t)bbv->capacity * SIMPOINT_DIMS * sizeof(double));
+        bbv->lengths = (long long*) realloc(bbv->lengths, bbv->capacity * sizeof(long long));
+        if (bbv->rows == NULL || bbv->lengths == NULL) {
+            printf("Out of memory recording basic block vectors\n");
+            exit(-1);
+        }
+    }
+    memcpy(&bbv->rows[(size_t)bbv->count * SIMPOINT_DIMS], row, SIMPOINT_DIMS * sizeof(double));
+    bbv->lengths[bbv->count++] = length;
+}
+
+/*
+ * Runs the program to its halt and records the projected basic block vector
+ * of every interval. counts[pc] is how many instructions the block starting
+ * at pc has executed in the current interval, touched lists those pcs.
+ */
+static long long profileBlocks(stateType* state, bbvType* bbv)
+{
+    long long* counts = (long long*) allocOrDie(NUMMEMORY, sizeof(long long));
+    int* touched = (int*) allocOrDie(NUMMEMORY, sizeof(int));
+    int numTouched = 0;
+    long long instrs = 0;
+    long long intervalStart = 0;
+    int blockStart = state->pc;
+    long long blockLength = 0;
+    bool running = true;
+    while (running) {
+        const decodedType* instr = &state->decoded[state->pc];
+        running = stepFunctional(state, instr);
+        instrs++;
+        blockLength++;
+        bool blockEnds = instr->handler == BEQ || instr->handler == JALR || !running;
+        bool intervalEnds = instrs - intervalStart == simpointInterval || !running;
+        if (blockEnds || intervalEnds) {
+            if (counts[blockStart] == 0) {
+                touched[numTouched++] = blockStart;
+            }
+            counts[blockStart] += blockLength;
+            blockLength = 0;
+            //an interval boundary splits the block, the rest counts as a block of its own
+            blockStart = state->pc;
+        }
+        if (intervalEnds) {
+            double row[SIMPOINT_DIMS] = {0};
+            long long length = instrs - intervalStart;
+            for (int t = 0; t < numTouched; t++) {
+                double share = (double) counts[touched[t]] / length;
+                for (int d = 0; d < SIMPOINT_DIMS; d++) {
+                    row[d] += share * projectionWeight(touched[t], d);
+                }
+                counts[touched[t]] = 0;
+            }
+            numTouched = 0;
+            addInterval(bbv, row, length);
+            intervalStart = instrs;
+        }
+    }
+    free(counts);
+    free(touched);
+    return instrs;
+}
+
+static double squaredDistance(const double* a, const double* b)
+{
+    double sum = 0;
+    for (int d = 0; d < SIMPOINT_DIMS; d++) {
+        sum += (a[d] - b[d]) * (a[d] - b[d]);
+    }
+    return sum;
+}
+
+/*
+ * Clusters the rows into k groups, writing each row's cluster to assign and
+ * the centres to centers. Seeds with k-means++ from rng. Returns the sum of
+ * squared distances from the rows to their centres.
+ */
+static double kMeans(const bbvType* bbv, int k, int* assign, double* centers, unsigned int* rng)
+{
+    int n = bbv->count;
+    double* nearest = (double*) allocOrDie(n, sizeof(double));
+    memcpy(centers, &bbv->rows[(size_t)(nextRandom(rng) % n) * SIMPOINT_DIMS], SIMPOINT_DIMS * sizeof(double));
+    for (int c = 1; c < k; c++) {
+        double total = 0;
+        for (int i = 0; i < n; i++) {
+            nearest[i] = DBL_MAX;
+            for (int j = 0; j < c; j++) {
+                double dist = squaredDistance(&bbv->rows[(size_t)i * SIMPOINT_DIMS], &centers[j * SIMPOINT_DIMS]);
+                nearest[i] = dist < nearest[i] ? dist : nearest[i];
+            }
+            total += nearest[i];
+        }
+        //a row is picked with probability proportional to its squared distance from the centres so far
+        double pick = (double) nextRandom(rng) / UINT_MAX * total;
+        int chosen = 0;
+        while (chosen < n - 1 && pick > nearest[chosen]) {
+            pick -= nearest[chosen];
+            chosen++;
+        }
+        memcpy(&centers[c * SIMPOINT_DIMS], &bbv->rows[(size_t)chosen * SIMPOINT_DIMS],
+               SIMPOINT_DIMS * sizeof(double));
+    }
+    free(nearest);
+
+    int* sizes = (int*) allocOrDie(k, sizeof(int));
+    double distortion = 0;
+    for (int round = 0; round < SIMPOINT_ITERATIONS; round++) {
+        bool changed = round == 0;
+        distortion = 0;
+        for (int i = 0; i < n; i++) {
+            int best = 0;
+            double bestDist = DBL_MAX;
+            for (int c = 0; c < k; c++) {
+                double dist = squaredDistance(&bbv->rows[(size_t)i * SIMPOINT_DIMS], &centers[c * SIMPOINT_DIMS]);
+                if (dist < bestDist) {
+                    best = c;
+                    bestDist = dist;
+                }
+            }
+            changed = changed || assign[i] != best;
+            assign[i] = best;
+            distortion += bestDist;
+        }
+        if (!changed) {
+            break;
+        }
+        //an empty cluster keeps its old centre
+        memset(sizes, 0, k * sizeof(int));
+        for (int i = 0; i < n; i++) {
+            if (sizes[assign[i]]++ == 0) {
+                memset(&centers[assign[i] * SIMPOINT_DIMS], 0, SIMPOINT_DIMS * sizeof(double));
+            }
+            for (int d = 0; d < SIMPOINT_DIMS; d++) {
+                centers[assign[i] * SIMPOINT_DIMS + d] += bbv->rows[(size_t)i * SIMPOINT_DIMS + d];
+            }
+        }
+        for (int c = 0; c < k; c++) {
+            for (int d = 0; sizes[c] > 0 && d < SIMPOINT_DIMS; d++) {
+                centers[c * SIMPOINT_DIMS + d] /= sizes[c];
+            }
+        }
+    }
+    free(sizes);
+    return distortion;
+}
+
+//the Bayesian information criterion of a clustering under a spherical Gaussian model, higher is better
+static double clusteringBic(int n, int k, const int* assign, double distortion)
+{
+    if (n <= k) {
+        return -DBL_MAX;
+    }
+    double variance = distortion / (n - k);
+    if (variance <= 0) {
+        //every row sits on its centre, nothing fits better
+        variance = DBL_MIN;
+    }
+    int* sizes = (int*) allocOrDie(k, sizeof(int));
+    for (int i = 0; i < n; i++) {
+        sizes[assign[i]]++;
+    }
+    double likelihood = 0;
+    for (int c = 0; c < k; c++) {
+        double rn = sizes[c];
+        if (rn == 0) {
+            continue;
+        }
+        likelihood += rn * log(rn) - rn * log((double) n) - rn / 2 * log(2 * M_PI) -
+                      rn * SIMPOINT_DIMS / 2 * log(variance) - (rn - k) / 2;
+    }
+    free(sizes);
+    double params = (k - 1) + (double) SIMPOINT_DIMS * k + 1;
+    return likelihood - params / 2 * log((double) n);
+}
+
+int simpointProfileMain(stateType* state)
+{
+    bbvType bbv;
+    memset(&bbv, 0, sizeof(bbv));
+    long long instrs = profileBlocks(state, &bbv);
+    int n = bbv.count;
+    int maxK = simpointMaxK < n ? simpointMaxK : n;
+    int* assigns = (int*) allocOrDie((size_t)maxK * n, sizeof(int));
+    double* centers = (double*) allocOrDie((size_t)maxK * maxK * SIMPOINT_DIMS, sizeof(double));
+    double* bic = (double*) allocOrDie(maxK, sizeof(double));
+    unsigned int rng = randomSeed != 0 ? randomSeed : 1;
+    double lowest = DBL_MAX;
+    double highest = -DBL_MAX;
+    for (int k = 1; k <= maxK; k++) {
+        int* assign = &assigns[(size_t)(k - 1) * n];
+        double distortion = kMeans(&bbv, k, assign, &centers[(size_t)(k - 1) * maxK * SIMPOINT_DIMS], &rng);
+        bic[k - 1] = clusteringBic(n, k, assign, distortion);
+        if (bic[k - 1] != -DBL_MAX) {
+            lowest = bic[k - 1] < lowest ? bic[k - 1] : lowest;
+            highest = bic[k - 1] > highest ? bic[k - 1] : highest;
+        }
+    }
+    int k = 1;
+    while (k < maxK && (bic[k - 1] == -DBL_MAX || bic[k - 1] < lowest + 0.9 * (highest - lowest))) {
+        k++;
+    }
+    int* assign = &assigns[(size_t)(k - 1) * n];
+    double* center = &centers[(size_t)(k - 1) * maxK * SIMPOINT_DIMS];
+
+    FILE* out = fopen(simpointFile, "w");
+    if (out == NULL) {
+        printf("Cannot write '%s' : %s\n", simpointFile, strerror(errno));
+        return -1;
+    }
+    fprintf(out, "interval %lld instructions %lld\n", simpointInterval, instrs);
+    printf("INSTRUCTIONS: %lld\n", instrs);
+    printf("SIMPOINT INTERVALS: %d\n", n);
+    printf("SIMPOINT CLUSTERS: %d\n", k);
+    for (int c = 0; c < k; c++) {
+        int best = -1;
+        double bestDist = DBL_MAX;
+        long long clusterInstrs = 0;
+        for (int i = 0; i < n; i++) {
+            if (assign[i] != c) {
+                continue;
+            }
+            clusterInstrs += bbv.lengths[i];
+            double dist = squaredDistance(&bbv.rows[(size_t)i * SIMPOINT_DIMS], &center[c * SIMPOINT_DIMS]);
+            if (dist < bestDist) {
+                best = i;
+                bestDist = dist;
+            }
+        }
+        if (best < 0) {
+            continue;
+        }
+        double weight = (double) clusterInstrs / instrs;
+        fprintf(out, "%d %.6f\n", best, weight);
+        printf("SIMPOINT %d: INTERVAL %d, WEIGHT %.4f\n", c, best, weight);
+    }
+    fclose(out);
+    free(assigns);
+    free(centers);
+    free(bic);
+    free(bbv.rows);
+    free(bbv.lengths);
+    return 0;
+}
+
+//one representative interval of a replay and what its detailed simulation measured
+typedef struct simpointStruct {
+    int interval;
+    double weight;
+    stateType *checkpoint;
+    long long instrs; //measured, short only for the program's last interval
+    long long cycles;
+    long long hits[MAX_LEVELS + 2];
+    long long misses[MAX_LEVELS + 2];
+} simpointType;
+
+int simpointReplayMain(stateType* image, const replPolicy* policy)
+{
+    FILE* in = fopen(simpointFile, "r");
+    if (in == NULL) {
+        printf("Cannot open file '%s' : %s\n", simpointFile, strerror(errno));
+        return -1;
+    }
+    long long interval;
+    long long total;
+    if (fscanf(in, "interval %lld instructions %lld", &interval, &total) != 2 || interval < 1) {
+        printf("'%s' is not a simpoint file\n", simpointFile);
+        fclose(in);
+        return -1;
+    }
+    simpointType* points = NULL;
+    int numPoints = 0;
+    int index;
+    double weight;
+    while (fscanf(in, "%d %lf", &index, &weight) == 2) {
+        points = (simpointType*) realloc(points, (numPoints + 1) * sizeof(simpointType));
+        if (points == NULL) {
+            printf("Out of memory reading '%s'\n", simpointFile);
+            exit(-1);
+        }
+        memset(&points[numPoints], 0, sizeof(simpointType));
+        points[numPoints].interval = index;
+        points[numPoints++].weight = weight;
+    }
+    fclose(in);
+
+    //one functional pass takes every checkpoint, the points are in no particular order
+    stateType* state = (stateType*) allocOrDie(1, sizeof(stateType));
+    memcpy(state, image, sizeof(stateType));
+    state->decoded = (decodedType*) allocOrDie(NUMMEMORY, sizeof(decodedType));
+    memcpy(state->decoded, image->decoded, NUMMEMORY * sizeof(decodedType));
+    long long instrs = 0;
+    bool running = true;
+    for (;;) {
+        long long next = LLONG_MAX;
+        for (int p = 0; p < numPoints; p++) {
+            long long start = points[p].interval * interval - simpointWarming;
+            start = start < 0 ? 0 : start;
+            if (start == instrs && points[p].checkpoint == NULL) {
+                points[p].checkpoint = (stateType*) allocOrDie(1, sizeof(stateType));
+                memcpy(points[p].checkpoint, state, sizeof(stateType));
+                points[p].checkpoint->decoded = NULL;
+            } else if (start > instrs && start < next) {
+                next = start;
+            }
+        }
+        if (next == LLONG_MAX || !running) {
+            break;
+        }
+        while (running && instrs < next) {
+            running = stepFunctional(state, &state->decoded[state->pc]);
+            instrs += running;
+        }
+    }
+    freeState(state);
+
+    sampleSums levels; //only its list of caches
+    long long detailed = 0;
+    printTransfers = false;
+    for (int p = 0; p < numPoints; p++) {
+        simpointType* point = &points[p];
+        if (point->checkpoint == NULL) {
+            printf("Interval %d is past the end of the program\n", point->interval);
+            return -1;
+        }
+        state = point->checkpoint;
+        predecode(state);
+        cacheType* icache;
+        cacheType* cache = newHierarchy(policy, &icache);
+        timingType timing;
+        memset(&timing, 0, sizeof(timing));
+        attachTiming(icache, cache, &timing);
+        listCaches(&levels, icache, cache);
+        long long start = (long long) point->interval * interval;
+        long long warmFrom = start - simpointWarming < 0 ? 0 : start - simpointWarming;
+        long long done = warmFrom;
+        bool halted = runSlice(state, icache, cache, &done, start);
+        long long cycles = totalCycles(&timing);
+        for (int c = 0; c < levels.numCaches; c++) {
+            point->hits[c] = -levels.caches[c]->hits;
+            point->misses[c] = -levels.caches[c]->misses;
+        }
+        if (!halted) {
+            runSlice(state, icache, cache, &done, start + interval);
+        }
+        point->instrs = done - start;
+        detailed += done - warmFrom;
+        point->cycles = totalCycles(&timing) - cycles;
+        for (int c = 0; c < levels.numCaches; c++) {
+            point->hits[c] += levels.caches[c]->hits;
+            point->misses[c] += levels.caches[c]->misses;
+        }
+        freeHierarchy(icache, cache);
+        freeState(state);
+        point->checkpoint = NULL;
+    }
+
+    //every rate is per instruction, so each point stands for weight * total instructions
+    double cpi = 0;
+    double hits[MAX_LEVELS + 2] = {0};
+    double misses[MAX_LEVELS + 2] = {0};
+    for (int p = 0; p < numPoints; p++) {
+        simpointType* point = &points[p];
+        double instrsPerPoint = point->instrs > 0 ? point->instrs : 1;
+        printf("SIMPOINT %d: INTERVAL %d, WEIGHT %.4f, CPI %.4f\n", p, point->interval, point->weight,
+               point->cycles / instrsPerPoint);
+        cpi += point->weight * point->cycles / instrsPerPoint;
+        for (int c = 0; c < levels.numCaches; c++) {
+            hits[c] += point->weight * total * point->hits[c] / instrsPerPoint;
+            misses[c] += point->weight * total * point->misses[c] / instrsPerPoint;
+        }
+    }
+    printf("INSTRUCTIONS: %lld\n", total);
+    printf("DETAILED INSTRUCTIONS: %lld\n", detailed);
+    printf("CPI: %.4f\n", cpi);
+    printf("CYCLES: %.0f\n", cpi * total);
+    for (int c = 0; c < levels.numCaches; c++) {
+        printf("%sHITS: %.0f\n", levels.names[c], hits[c]);
+        printf("%sMISSES: %.0f\n", levels.names[c], misses[c]);
+        printf("%sMISS RATE: %.4f%%\n", levels.names[c],
+               hits[c] + misses[c] > 0 ? 100.0 * misses[c] / (hits[c] + misses[c]) : 0.0);
+    }
+    free(points);
+    return 0;
+}
+
+/**************** Checkpoints *****************************/
+/*
+ * --checkpoint-save writes the machine and every cache of the hierarchy to
+ * a binary file once checkpointAt instructions have run, and the run then
+ * carries on as usual. With --checkpoint-restore the file argument is such a
+ * checkpoint rather than a program, and the run starts from it. The file is laid out so it
+ * can be used straight from the mapping: a fixed header holding the
+ * registers, pc and the memory as the program sees it (dirty cache data
+ * merged in), one descriptor and its arrays per cache, and then the last
+ * accesses before the checkpoint. Every section is padded to 8 bytes.
+ *
+ * If the restoring run's hierarchy matches the saved one cache for cache
+ * (geometry, policy, inclusion and write policy), tags, valid and dirty
+ * bits, replacement state and data all come back as they were. Otherwise
+ * only the architectural state is used and the new caches are rewarmed by
+ * replaying the recorded accesses through them tag-only, the way --sample
+ * fast-forwards, so one checkpoint serves every configuration.
+ */
+#define CHECKPOINT_MAGIC "LC2KCKPT"
+#define CHECKPOINT_VERSION 2
+#define MAX_REPL_ARRAYS 4
+
+typedef struct checkpointHeaderStruct {
+    char magic[8];
+    int32_t version;
+    int32_t numCaches;
+    int64_t instructions; //run before the checkpoint
+    int64_t traceLength;
+    int32_t pc;
+    int32_t numMemory;
+    int32_t reg[NUMREGS];
+    int32_t mem[NUMMEMORY];
+} checkpointHeader;
+
+typedef struct checkpointCacheStruct {
+    int32_t role; //0 the first level data cache, 1 a split instruction cache, 2 and up the --level caches
+    int32_t blockSize;
+    int32_t numSets;
+    int32_t assoc;
+    char policy[16];
+    int32_t inclusion;
+    int32_t writePolicy;
+    int32_t writeAllocate;
+    int32_t numArrays; //of replacement state, each stored as an int64 size and then the bytes
+    int64_t bytes; //of the arrays that follow the descriptor, padding included
+} checkpointCache;
+
+typedef struct checkpointStruct {
+    void *map;
+    size_t size;
+    const checkpointHeader *header;
+} checkpointType;
+
+static size_t padded(size_t bytes)
+{
+    return (bytes + 7) & ~(size_t)7;
+}
+
+static void writePadded(FILE* out, const void* data, size_t bytes)
+{
+    static const char zeros[8];
+    fwrite(data, 1, bytes, out);
+    fwrite(zeros, 1, padded(bytes) - bytes, out);
+}
+
+//the caches of a hierarchy in checkpoint order, returns how many
+static int checkpointCaches(cacheType* icache, cacheType* dcache, cacheType** caches, int* roles)
+{
+    int n = 0;
+    caches[n] = dcache;
+    roles[n++] = 0;
+    if (icache != dcache) {
+        caches[n] = icache;
+        roles[n++] = 1;
+    }
+    int role = 2;
+    for (cacheType* c = dcache->next; c != NULL; c = c->next) {
+        caches[n] = c;
+        roles[n++] = role++;
+    }
+    return n;
+}
+
+//the descriptor of cache as it would be saved, ptrs and sizes get its replacement state arrays
+static checkpointCache describeCache(cacheType* cache, int role, void** ptrs, size_t* sizes)
+{
+    size_t numLines = (size_t)cache->geo.numSets * cache->assoc;
+    checkpointCache desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.role = role;
+    desc.blockSize = cache->geo.blockSize;
+    desc.numSets = cache->geo.numSets;
+    desc.assoc = cache->assoc;
+    strncpy(desc.policy, cache->policy->name, sizeof(desc.policy) - 1);
+    desc.inclusion = cache->inclusion;
+    desc.writePolicy = cache->writePolicy;
+    desc.writeAllocate = cache->writeAllocate;
+    desc.numArrays = cache->policy->arrays != NULL ? cache->policy->arrays(cache, ptrs, sizes) : 0;
+    desc.bytes = padded(numLines * sizeof(int)) + 2 * padded(numLines) + padded(cache->geo.numSets * sizeof(int)) +
+                 padded(numLines * cache->geo.blockSize * sizeof(int));
+    for (int a = 0; a < desc.numArrays; a++) {
+        desc.bytes += sizeof(int64_t) + padded(sizes[a]);
+    }
+    return desc;
+}
+
+static void writeCache(FILE* out, cacheType* cache, int role)
+{
+    size_t numLines = (size_t)cache->geo.numSets * cache->assoc;
+    void* ptrs[MAX_REPL_ARRAYS];
+    size_t sizes[MAX_REPL_ARRAYS];
+    checkpointCache desc = describeCache(cache, role, ptrs, sizes);
+    fwrite(&desc, sizeof(desc), 1, out);
+    writePadded(out, cache->tags, numLines * sizeof(int));
+    writePadded(out, cache->valid, numLines);
+    writePadded(out, cache->dirty, numLines);
+    writePadded(out, cache->numValid, cache->geo.numSets * sizeof(int));
+    writePadded(out, cache->data, numLines * cache->geo.blockSize * sizeof(int));
+    for (int a = 0; a < desc.numArrays; a++) {
+        int64_t size = (int64_t) sizes[a];
+        fwrite(&size, sizeof(size), 1, out);
+        writePadded(out, ptrs[a], sizes[a]);
+    }
+}
+
+static int saveCheckpoint(const char* path, stateType* state, cacheType* icache, cacheType* dcache,
+                          long long instrs, const accessRecord* trace, long long traceLength)
+{
+    cacheType* caches[MAX_LEVELS + 2];
+    int roles[MAX_LEVELS + 2];
+    int numCaches = checkpointCaches(icache, dcache, caches, roles);
+    checkpointHeader* header = (checkpointHeader*) allocOrDie(1, sizeof(checkpointHeader));
+    memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+    header->version = CHECKPOINT_VERSION;
+    header->numCaches = numCaches;
+    header->instructions = instrs;
+    header->traceLength = traceLength;
+    header->pc = state->pc;
+    header->numMemory = state->numMemory;
+    memcpy(header->reg, state->reg, sizeof(header->reg));
+    //the memory the program would see, without disturbing the run's own
+    stateType* merged = (stateType*) allocOrDie(1, sizeof(stateType));
+    memcpy(merged->mem, state->mem, sizeof(merged->mem));
+    writeDirtyLines(dcache, merged);
+    memcpy(header->mem, merged->mem, sizeof(header->mem));
+    free(merged);
+
+    FILE* out = fopen(path, "wb");
+    if (out == NULL) {
+        printf("Cannot write '%s' : %s\n", path, strerror(errno));
+        free(header);
+        return -1;
+    }
+    fwrite(header, sizeof(checkpointHeader), 1, out);
+    free(header);
+    for (int c = 0; c < numCaches; c++) {
+        writeCache(out, caches[c], roles[c]);
+    }
+    writePadded(out, trace, traceLength * sizeof(accessRecord));
+    if (ferror(out) || fclose(out) != 0) {
+        printf("Cannot write '%s' : %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+//puts the recorded accesses oldest first at the start of the ring, returns how many there are
+static long long oldestFirst(accessRecorder* recorder)
+{
+    long long length = recorder->length;
+    if (recorder->count <= length) {
+        return recorder->count;
+    }
+    accessRecord* oldest = (accessRecord*) allocOrDie(length, sizeof(accessRecord));
+    long long head = recorder->count % length;
+    memcpy(oldest, &recorder->ring[head], (length - head) * sizeof(accessRecord));
+    memcpy(&oldest[length - head], recorder->ring, head * sizeof(accessRecord));
+    memcpy(recorder->ring, oldest, length * sizeof(accessRecord));
+    free(oldest);
+    return length;
+}
+
+/*
+ * Runs the program to its halt like run(), writing a checkpoint on the way
+ * once checkpointAt instructions have run. Up to then the data cache records
+ * the last checkpointTrace accesses in a ring; after it nothing is recorded.
+ */
+long long runSavingCheckpoint(stateType* state, cacheType* icache, cacheType* dcache)
+{
+    accessRecorder recorder = {NULL, checkpointTrace, 0};
+    if (checkpointTrace > 0) {
+        recorder.ring = (accessRecord*) allocOrDie(checkpointTrace, sizeof(accessRecord));
+        dcache->recorder = &recorder;
+    }
+    long long instrs = 0;
+    bool halted = runSlice(state, icache, dcache, &instrs, checkpointAt);
+    dcache->recorder = NULL;
+    if (halted) {
+        printf("The program halted before instruction %lld, no checkpoint was written\n", checkpointAt);
+    } else {
+        long long traceLength = oldestFirst(&recorder);
+        if (saveCheckpoint(checkpointSaveFile, state, icache, dcache, instrs, recorder.ring, traceLength) != 0) {
+            exit(-1);
+        }
+        printf("CHECKPOINT INSTRUCTIONS: %lld\n", instrs);
+        runSlice(state, icache, dcache, &instrs, LLONG_MAX);
+    }
+    free(recorder.ring);
+    return instrs;
+}
+
+//maps a checkpoint file and checks its header, 0 on success
+int openCheckpoint(checkpointType* checkpoint, const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Cannot open file '%s' : %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(checkpointHeader)) {
+        printf("'%s' is not a checkpoint\n", path);
+        close(fd);
+        return -1;
+    }
+    checkpoint->size = (size_t) info.st_size;
+    checkpoint->map = mmap(NULL, checkpoint->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (checkpoint->map == MAP_FAILED) {
+        printf("Cannot map '%s' : %s\n", path, strerror(errno));
+        return -1;
+    }
+    checkpoint->header = (const checkpointHeader*) checkpoint->map;
+    if (memcmp(checkpoint->header->magic, CHECKPOINT_MAGIC, sizeof(checkpoint->header->magic)) != 0) {
+        printf("'%s' is not a checkpoint\n", path);
+        munmap(checkpoint->map, checkpoint->size);
+        return -1;
+    }
+    if (checkpoint->header->version != CHECKPOINT_VERSION) {
+        printf("'%s' is a version %d checkpoint, this simulator reads version %d\n", path,
+               checkpoint->header->version, CHECKPOINT_VERSION);
+        munmap(checkpoint->map, checkpoint->size);
+        return -1;
+    }
+    //the engines index memory with the pc unchecked
+    const checkpointHeader* header = checkpoint->header;
+    if (header->pc < 0 || header->pc >= NUMMEMORY || header->numMemory < 0 || header->numMemory > NUMMEMORY ||
+        header->numCaches < 0 || header->traceLength < 0) {
+        printf("'%s' is a damaged checkpoint\n", path);
+        munmap(checkpoint->map, checkpoint->size);
+        return -1;
+    }
+    return 0;
+}
+
+void closeCheckpoint(checkpointType* checkpoint)
+{
+    munmap(checkpoint->map, checkpoint->size);
+}
+
+//a fresh machine state holding the checkpoint's registers, pc and memory
+stateType* checkpointState(const checkpointType* checkpoint)
+{
+    const checkpointHeader* header = checkpoint->header;
+    stateType* state = (stateType*) allocOrDie(1, sizeof(stateType));
+    state->pc = header->pc;
+    state->numMemory = header->numMemory;
+    memcpy(state->reg, header->reg, sizeof(state->reg));
+    memcpy(state->mem, header->mem, sizeof(state->mem));
+    predecode(state);
+    return state;
+}
+
+//the next bytes of the file at *p, padding skipped; stops the run if the file ends first
+static const unsigned char* takeBytes(const unsigned char** p, const unsigned char* end, size_t bytes)
+{
+    const unsigned char* start = *p;
+    if ((size_t) (end - start) < padded(bytes)) {
+        printf("The checkpoint is truncated\n");
+        exit(-1);
+    }
+    *p += padded(bytes);
+    return start;
+}
+
+/*
+ * Brings the caches to where the checkpoint left them: exactly, if the
+ * hierarchy is the one that was saved, or else by rewarming from the
+ * recorded accesses. Returns true for an exact restore.
+ */
+bool restoreCaches(const checkpointType* checkpoint, stateType* state, cacheType* icache, cacheType* dcache)
+{
+    const checkpointHeader* header = checkpoint->header;
+    const unsigned char* end = (const unsigned char*) checkpoint->map + checkpoint->size;
+    const unsigned char* p = (const unsigned char*) checkpoint->map + sizeof(checkpointHeader);
+    cacheType* caches[MAX_LEVELS + 2];
+    int roles[MAX_LEVELS + 2];
+    int numCaches = checkpointCaches(icache, dcache, caches, roles);
+    bool exact = header->numCaches == numCaches;
+    //first pass: does every saved cache match, and where does the trace start
+    for (int c = 0; c < header->numCaches; c++) {
+        if ((size_t) (end - p) < sizeof(checkpointCache)) {
+            printf("The checkpoint is truncated\n");
+            exit(-1);
+        }
+        const checkpointCache* desc = (const checkpointCache*) p;
+        void* ptrs[MAX_REPL_ARRAYS];
+        size_t sizes[MAX_REPL_ARRAYS];
+        checkpointCache wanted = c < numCaches ? describeCache(caches[c], roles[c], ptrs, sizes) : *desc;
+        //matching sizes as well as shapes, so the second pass reads exactly the arrays that are there
+        exact = exact && c < numCaches && desc->role == wanted.role && desc->blockSize == wanted.blockSize &&
+                desc->numSets == wanted.numSets && desc->assoc == wanted.assoc &&
+                strncmp(desc->policy, wanted.policy, sizeof(desc->policy)) == 0 &&
+                desc->inclusion == wanted.inclusion && desc->writePolicy == wanted.writePolicy &&
+                desc->writeAllocate == wanted.writeAllocate && desc->numArrays == wanted.numArrays &&
+                desc->bytes == wanted.bytes;
+        p += sizeof(checkpointCache);
+        if (desc->bytes < 0 || desc->bytes > end - p) {
+            printf("The checkpoint is truncated\n");
+            exit(-1);
+        }
+        p += desc->bytes;
+    }
+    const accessRecord* trace = (const accessRecord*) p;
+    if ((size_t) header->traceLength > (size_t) (end - p) / sizeof(accessRecord)) {
+        printf("The checkpoint is truncated\n");
+        exit(-1);
+    }
+
+    if (!exact) {
+        for (long long i = 0; i < header->traceLength; i++) {
+            const accessRecord* access = &trace[i];
+            //an address the program computed outside memory has no block to warm
+            if (access->addr < 0 || access->addr >= NUMMEMORY) {
+                continue;
+            }
+            warmAccess(access->flags & TRACE_FETCH ? icache : dcache, state, access->addr,
+                       (access->flags & TRACE_WRITE) != 0);
+        }
+        if (icache != dcache) {
+            reloadLines(icache, state);
+        }
+        reloadLines(dcache, state);
+        return false;
+    }
+
+    p = (const unsigned char*) checkpoint->map + sizeof(checkpointHeader);
+    for (int c = 0; c < numCaches; c++) {
+        cacheType* cache = caches[c];
+        size_t numLines = (size_t)cache->geo.numSets * cache->assoc;
+        //the first pass matched the descriptor, so only the arrays after it are left
+        p += sizeof(checkpointCache);
+        memcpy(cache->tags, takeBytes(&p, end, numLines * sizeof(int)), numLines * sizeof(int));
+        memcpy(cache->valid, takeBytes(&p, end, numLines), numLines);
+        memcpy(cache->dirty, takeBytes(&p, end, numLines), numLines);
+        memcpy(cache->numValid, takeBytes(&p, end, cache->geo.numSets * sizeof(int)),
+               cache->geo.numSets * sizeof(int));
+        memcpy(cache->data, takeBytes(&p, end, numLines * cache->geo.blockSize * sizeof(int)),
+               numLines * cache->geo.blockSize * sizeof(int));
+        void* ptrs[MAX_REPL_ARRAYS];
+        size_t sizes[MAX_REPL_ARRAYS];
+        int numArrays = cache->policy->arrays(cache, ptrs, sizes);
+        for (int a = 0; a < numArrays; a++) {
+            int64_t size;
+            memcpy(&size, takeBytes(&p, end, sizeof(size)), sizeof(size));
+            if ((size_t) size != sizes[a]) {
+                printf("The checkpoint's %s state does not fit this cache\n", cache->policy->name);
+                exit(-1);
+            }
+            memcpy(ptrs[a], takeBytes(&p, end, sizes[a]), sizes[a]);
+        }
+    }
+    return true;
+}
+
+void appendTrace(accessTrace* trace, int addr)
+{
+    if(trace->length == trace->capacity)
+    {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 4096;
+        trace->addrs = (int*) realloc(trace->addrs, trace->capacity * sizeof(int));
+        if(trace->addrs == NULL)
+        {
+            printf("Out of memory recording the access stream\n");
+            exit(-1);
+        }
+    }
+    trace->addrs[trace->length++] = addr;
+}
+
+/*
+ * Runs the program in image straight out of memory with no cache in the way,
+ * on a copy so image is left as it was, and records every address it
+ * fetches from, loads from or stores to. Each step is stepFunctional(), the
+ * same execution --sample and --simpoint use, including the re-decode after
+ * a store, so self-modifying code runs as it does in the engines. The cache
+ * never changes what a program computes, so this is exactly the stream the
+ * cached run will go on to make.
+ */
+void traceAccesses(const stateType* image, accessTrace* trace)
+{
+    stateType* state = (stateType*) allocOrDie(1, sizeof(stateType));
+    memcpy(state, image, sizeof(stateType));
+    state->decoded = (decodedType*) allocOrDie(NUMMEMORY, sizeof(decodedType));
+    memcpy(state->decoded, image->decoded, NUMMEMORY * sizeof(decodedType));
+    bool running = true;
+    while(running){
+        const decodedType* instr = &state->decoded[state->pc];
+        appendTrace(trace, state->pc);
+        if(instr->handler == LW || instr->handler == SW){
+            appendTrace(trace, state->reg[instr->regB] + instr->offset);
+        }
+        running = stepFunctional(state, instr);
+    }
+    freeState(state);
+}
+
+//fills in state->decoded, see decodeInstr()
+void predecode(stateType* state)
+{
+    state->decoded = (decodedType*) allocOrDie(NUMMEMORY, sizeof(decodedType));
+    for (int i = 0; i < NUMMEMORY; i++) {
+        state->decoded[i] = decodeInstr(state->mem[i]);
+    }
+}
+
+void freeState(stateType* state)
+{
+    free(state->decoded);
+    free(state);
+}
+
+//reads a machine code file, one word per line, into a fresh machine state and closes it
+stateType* loadState(FILE* fp)
+{
+    /* count the number of lines by counting newline characters */
+    int line_count = 0;
+    int c;
+    while (EOF != (c = getc(fp))) {
+        if (c == '\n') {
+            line_count++;
+        }
+    }
+    // reset fp to the beginning of the file
+    rewind(fp);
+
+    stateType *state = (stateType *) malloc(sizeof(stateType));
+
+    state->pc = 0;
+    memset(state->mem, 0, NUMMEMORY * sizeof(int));
+    memset(state->reg, 0, NUMREGS * sizeof(int));
+
+    state->numMemory = line_count;
+
+    char line[256];
+
+    int i = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        /* note that fgets doesn't strip the terminating \n, checking its
+           presence would allow to handle lines longer that sizeof(line) */
+        state->mem[i] = atoi(line);
+        i++;
+    }
+    fclose(fp);
+    predecode(state);
+    return state;
+}
+
+/*
+ * Parses a list of sizes for the multi-configuration modes: a single number,
+ * a comma separated list ("1,2,8") or a doubling range ("1:64" is 1, 2, 4,
+ * ... 64). Returns how many sizes were written, or -1 if the text is bad.
+ */
+int parseSizeList(const char* text, int* sizes, int maxSizes)
+{
+    int count = 0;
+    const char* colon = strchr(text, ':');
+    if (colon != NULL) {
+        int lo = atoi(text);
+        int hi = atoi(colon + 1);
+        if (lo < 1 || hi < lo) {
+            return -1;
+        }
+        for (long size = lo; size <= hi && count < maxSizes; size *= 2) {
+            sizes[count++] = (int) size;
+        }
+        return count;
+    }
+    while (*text != '\0' && count < maxSizes) {
+        char* end;
+        long size = strtol(text, &end, 10);
+        if (end == text || size < 1 || size > INT_MAX) {
+            return -1;
+        }
+        sizes[count++] = (int) size;
+        text = (*end == ',') ? end + 1 : end;
+        if (*end != ',' && *end != '\0') {
+            return -1;
+        }
+    }
+    return count;
+}
+
+//Fenwick tree over positions 1..size, used to count marked positions in a prefix
+static ALWAYS_INLINE void fenwickAdd(int* tree, int size, int pos, int delta)
+{
+    for (; pos <= size; pos += pos & -pos) {
+        tree[pos] += delta;
+    }
+}
+
+static ALWAYS_INLINE int fenwickSum(const int* tree, int pos)
+{
+    int sum = 0;
+    for (; pos > 0; pos -= pos & -pos) {
+        sum += tree[pos];
+    }
+    return sum;
+}
+
+/*
+ * Mattson stack-distance analysis for one block size and set count. Under
+ * LRU an access hits in an A-way cache exactly when fewer than A other
+ * blocks of its set were touched since the block's last access, so one pass
+ * gives the result for every associativity. The accesses are bucketed by set
+ * and each set's subsequence is walked with a Fenwick tree that marks the
+ * position of every block's most recent access; the number of marks after a
+ * block's previous position is its stack distance. hist[d] counts accesses
+ * at distance d for d < maxAssoc, and hist[maxAssoc] counts both the cold
+ * misses and those further away.
+ */
+void stackDistances(const accessTrace* trace, int blkSize, int numSets, int maxAssoc, long long* hist)
+{
+    long length = trace->length;
+    int numBlocks = NUMMEMORY / blkSize + 1;
+    int* start = (int*) allocOrDie((size_t)numSets + 1, sizeof(int));
+    int* order = (int*) allocOrDie(length, sizeof(int));
+    int* last = (int*) allocOrDie(numBlocks, sizeof(int));
+    int* tree = (int*) allocOrDie(length + 1, sizeof(int));
+
+    //bucket the accesses by set, keeping program order within each set
+    for (long i = 0; i < length; i++) {
+        start[(trace->addrs[i] / blkSize) % numSets + 1]++;
+    }
+    for (int s = 0; s < numSets; s++) {
+        start[s + 1] += start[s];
+    }
+    int* fill = (int*) allocOrDie(numSets, sizeof(int));
+    for (long i = 0; i < length; i++) {
+        int s = (trace->addrs[i] / blkSize) % numSets;
+        order[start[s] + fill[s]++] = trace->addrs[i] / blkSize;
+    }
+    free(fill);
+
+    memset(hist, 0, (maxAssoc + 1) * sizeof(long long));
+    for (int b = 0; b < numBlocks; b++) {
+        last[b] = -1;
+    }
+    //every block belongs to a single set, so last[] never needs resetting between sets
+    for (int s = 0; s < numSets; s++) {
+        int size = start[s + 1] - start[s];
+        const int* blocks = &order[start[s]];
+        memset(tree, 0, (size + 1) * sizeof(int));
+        for (int pos = 1; pos <= size; pos++) {
+            int block = blocks[pos - 1];
+            if (last[block] < 0) {
+                hist[maxAssoc]++;
+            } else {
+                int distance = fenwickSum(tree, pos - 1) - fenwickSum(tree, last[block]);
+                hist[distance < maxAssoc ? distance : maxAssoc]++;
+                fenwickAdd(tree, size, last[block], -1);
+            }
+            fenwickAdd(tree, size, pos, 1);
+            last[block] = pos;
+        }
+    }
+    free(start);
+    free(order);
+    free(last);
+    free(tree);
+}
+
+#define MAX_SIZES 64 /* most entries accepted in one size list */
+
+/*
+ * --stack-distance: runs the program once and reports LRU hits and misses
+ * for every block size and set count in the lists and every associativity
+ * from 1 to maxAssoc.
+ */
+int stackDistanceMain(char** args)
+{
+    int blockSizes[MAX_SIZES];
+    int setCounts[MAX_SIZES];
+    int numBlockSizes = parseSizeList(args[1], blockSizes, MAX_SIZES);
+    int numSetCounts = parseSizeList(args[2], setCounts, MAX_SIZES);
+    int maxAssoc = atoi(args[3]);
+    if (numBlockSizes < 1 || numSetCounts < 1 || maxAssoc < 1) {
+        printf("Block sizes and set counts must be lists like 4, 1,2,8 or 1:64 and the\n");
+        printf("maximum associativity must be 1 or greater\n");
+        return -1;
+    }
+    FILE *fp = fopen(args[0], "r");
+    if (fp == NULL) {
+        printf("Cannot open file '%s' : %s\n", args[0], strerror(errno));
+        return -1;
+    }
+    stateType *state = loadState(fp);
+    accessTrace trace = {NULL, 0, 0};
+    traceAccesses(state, &trace);
+    freeState(state);
+
+    long long* hist = (long long*) allocOrDie(maxAssoc + 1, sizeof(long long));
+    printf("BLOCK SIZE\tSETS\tASSOC\tHITS\tMISSES\tMISS RATE\n");
+    for (int b = 0; b < numBlockSizes; b++) {
+        for (int s = 0; s < numSetCounts; s++) {
+            stackDistances(&trace, blockSizes[b], setCounts[s], maxAssoc, hist);
+            long long hits = 0;
+            for (int assoc = 1; assoc <= maxAssoc; assoc++) {
+                hits += hist[assoc - 1];
+                long long misses = trace.length - hits;
+                printf("%d\t%d\t%d\t%lld\t%lld\t%.4f%%\n", blockSizes[b], setCounts[s], assoc,
+                       hits, misses, trace.length ? 100.0 * misses / trace.length : 0.0);
+            }
+        }
+    }
+    free(hist);
+    free(trace.addrs);
+    return 0;
+}
+
+/*
+ * --sweep: simulates every combination of the block size, set count and
+ * associativity lists in one process. The program is loaded once into a
+ * read-only image and each worker thread copies it into its own state
+ * before each configuration. Configurations are dealt out to the workers in
+ * contiguous runs; a worker takes from the back of its own run and, once
+ * that is empty, steals from the front of another worker's, so long running
+ * configurations do not leave the other cores idle.
+ */
+typedef struct sweepTaskStruct {
+    int blockSize;
+    int numSets;
+    int assoc;
+    long long instructions;
+    long long hits;
+    long long misses;
+    long long writebacks;
+    long long victimHits;
+    long long cycles;
+} sweepTask;
+
+struct sweepPoolStruct;
+
+typedef struct sweepWorkerStruct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int top; //the task a thief takes next
+    int bottom; //one past the task the owner takes next
+    int id;
+    struct sweepPoolStruct *pool;
+} sweepWorker;
+
+typedef struct sweepPoolStruct {
+    sweepTask *tasks;
+    sweepWorker *workers;
+    int numWorkers;
+    const stateType *image;
+    const replPolicy *policy;
+} sweepPool;
+
+static int takeOwnTask(sweepWorker* worker)
+{
+    int task = -1;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->top < worker->bottom) {
+        task = --worker->bottom;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return task;
+}
+
+static int stealTask(sweepWorker* thief)
+{
+    sweepPool* pool = thief->pool;
+    for (int i = 1; i < pool->numWorkers; i++) {
+        sweepWorker* victim = &pool->workers[(thief->id + i) % pool->numWorkers];
+        int task = -1;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->top < victim->bottom) {
+            task = victim->top++;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (task >= 0) {
+            return task;
+        }
+    }
+    return -1;
+}
+
+static void* sweepWorkerMain(void* arg)
+{
+    sweepWorker* worker = (sweepWorker*) arg;
+    sweepPool* pool = worker->pool;
+    stateType* state = (stateType*) allocOrDie(1, sizeof(stateType));
+    decodedType* decoded = (decodedType*) allocOrDie(NUMMEMORY, sizeof(decodedType));
+    int index;
+    while ((index = takeOwnTask(worker)) >= 0 || (index = stealTask(worker)) >= 0) {
+        sweepTask* task = &pool->tasks[index];
+        memcpy(state, pool->image, sizeof(stateType));
+        memcpy(decoded, pool->image->decoded, NUMMEMORY * sizeof(decodedType));
+        state->decoded = decoded;
+        cacheType* cache = newCache(task->blockSize, task->numSets, task->assoc, pool->policy);
+        setWritePolicy(cache);
+        if (victimEntries > 0) {
+            attachVictimCache(cache, victimEntries);
+        }
+        if (prefetchKind != PREFETCH_NONE) {
+            attachPrefetcher(cache, prefetchKind);
+        }
+        if (numMshrs > 0) {
+            cache->mshrs = newMshrFile(numMshrs, mshrLatency);
+        }
+        timingType timing;
+        memset(&timing, 0, sizeof(timing));
+        attachTiming(cache, cache, &timing);
+        task->instructions = run(state, cache, cache);
+        task->cycles = totalCycles(&timing);
+        task->hits = cache->hits;
+        task->misses = cache->misses;
+        task->writebacks = cache->writebacks;
+        if (cache->victims != NULL) {
+            task->writebacks += cache->victims->writebacks;
+            task->victimHits = cache->victims->hits;
+        }
+        freeCache(cache);
+    }
+    free(decoded);
+    free(state);
+    return NULL;
+}
+
+int sweepMain(char** args, const replPolicy* policy)
+{
+    int blockSizes[MAX_SIZES];
+    int setCounts[MAX_SIZES];
+    int assocs[MAX_SIZES];
+    int numBlockSizes = parseSizeList(args[1], blockSizes, MAX_SIZES);
+    int numSetCounts = parseSizeList(args[2], setCounts, MAX_SIZES);
+    int numAssocs = parseSizeList(args[3], assocs, MAX_SIZES);
+    if (numBlockSizes < 1 || numSetCounts < 1 || numAssocs < 1) {
+        printf("Block sizes, set counts and associativities must be lists like 4, 1,2,8 or 1:64\n");
+        return -1;
+    }
+    if (prefetchKind != PREFETCH_NONE && policy->needsFuture) {
+        printf("The %s policy cannot be combined with prefetching\n", policy->name);
+        return -1;
+    }
+    if (!writeAllocate && policy->needsFuture) {
+        //a store miss that allocates nothing is neither a touch nor a fill, so the policy would lose its place
+        printf("The %s policy cannot be combined with --no-write-allocate\n", policy->name);
+        return -1;
+    }
+    for (int a = 0; a < numAssocs; a++) {
+        if (policy->pow2Ways && log2Exact(assocs[a]) < 0) {
+            printf("The %s policy needs a power of two associativity\n", policy->name);
+            return -1;
+        }
+    }
+    FILE *fp = fopen(args[0], "r");
+    if (fp == NULL) {
+        printf("Cannot open file '%s' : %s\n", args[0], strerror(errno));
+        return -1;
+    }
+    stateType *image = loadState(fp);
+    if (policy->needsFuture) {
+        traceAccesses(image, &oracleTrace);
+    }
+
+    sweepPool pool;
+    int numTasks = numBlockSizes * numSetCounts * numAssocs;
+    pool.tasks = (sweepTask*) allocOrDie(numTasks, sizeof(sweepTask));
+    for (int b = 0, t = 0; b < numBlockSizes; b++) {
+        for (int s = 0; s < numSetCounts; s++) {
+            for (int a = 0; a < numAssocs; a++, t++) {
+                pool.tasks[t].blockSize = blockSizes[b];
+                pool.tasks[t].numSets = setCounts[s];
+                pool.tasks[t].assoc = assocs[a];
+            }
+        }
+    }
+    pool.numWorkers = numThreads > 0 ? numThreads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (pool.numWorkers < 1) {
+        pool.numWorkers = 1;
+    }
+    if (pool.numWorkers > numTasks) {
+        pool.numWorkers = numTasks;
+    }
+    pool.workers = (sweepWorker*) allocOrDie(pool.numWorkers, sizeof(sweepWorker));
+    pool.image = image;
+    pool.policy = policy;
+
+    printTransfers = false;
+    for (int w = 0; w < pool.numWorkers; w++) {
+        sweepWorker* worker = &pool.workers[w];
+        worker->id = w;
+        worker->pool = &pool;
+        worker->top = (int) ((long) numTasks * w / pool.numWorkers);
+        worker->bottom = (int) ((long) numTasks * (w + 1) / pool.numWorkers);
+        pthread_mutex_init(&worker->lock, NULL);
+    }
+    for (int w = 0; w < pool.numWorkers; w++) {
+        if (pthread_create(&pool.workers[w].thread, NULL, sweepWorkerMain, &pool.workers[w]) != 0) {
+            printf("Cannot start sweep thread %d\n", w);
+            exit(-1);
+        }
+    }
+    for (int w = 0; w < pool.numWorkers; w++) {
+        pthread_join(pool.workers[w].thread, NULL);
+        pthread_mutex_destroy(&pool.workers[w].lock);
+    }
+
+    printf("BLOCK SIZE\tSETS\tASSOC\tINSTRUCTIONS\tHITS\tMISSES\tWRITEBACKS\tMISS RATE\tCYCLES\tCPI%s\n",
+           victimEntries > 0 ? "\tVICTIM HITS" : "");
+    for (int t = 0; t < numTasks; t++) {
+        sweepTask* task = &pool.tasks[t];
+        long long accesses = task->hits + task->misses;
+        printf("%d\t%d\t%d\t%lld\t%lld\t%lld\t%lld\t%.4f%%", task->blockSize, task->numSets,
+               task->assoc, task->instructions, task->hits, task->misses, task->writebacks,
+               accesses ? 100.0 * task->misses / accesses : 0.0);
+        printf("\t%lld\t%.4f", task->cycles,
+               task->instructions ? (double) task->cycles / task->instructions : 0.0);
+        if (victimEntries > 0) {
+            printf("\t%lld", task->victimHits);
+        }
+        printf("\n");
+    }
+    free(pool.tasks);
+    free(pool.workers);
+    freeState(image);
+    free(oracleTrace.addrs);
+    return 0;
+}
+
+void printUsage(char* prog)
+{
+    printf("usage: %s [options] <machine code file> <block size> <number of sets> <associativity>\n", prog);
+    printf("       %s [options]    (prompts for the file and cache geometry)\n", prog);
+    printf("options:\n");
+    printf("  --policy <name>   replacement policy: lru (default), plru, fifo, random, lfu, srrip, brrip,\n");
+    printf("                    or opt (Belady's optimal, found with an extra functional pass)\n");
+    printf("  --seed <n>        seed for the random and brrip policies (default 1)\n");
+    printf("  --quiet           do not print each transfer, only the final statistics\n");
+    printf("  --stack-distance  one pass LRU results for many caches; the block size and number\n");
+    printf("                    of sets become lists (4, 1,2,8 or the doubling range 1:64) and\n");
+    printf("                    results are printed for every associativity up to the given one\n");
+    printf("  --sweep           simulate every combination of the block size, number of sets and\n");
+    printf("                    associativity lists in parallel and print one table\n");
+    printf("  --threads <n>     worker threads for --sweep (default one per core)\n");
+    printf("  --level <b>,<s>,<a>[,<h>]  add a cache level below the last one, with that block size,\n");
+    printf("                    number of sets, associativity and hit latency (default 10 cycles;\n");
+    printf("                    repeat for L3 and beyond)\n");
+    printf("  --inclusion <p>   how the levels relate: nine (default, non-inclusive non-exclusive),\n");
+    printf("                    inclusive (back-invalidates above) or exclusive (victims move down)\n");
+    printf("  --icache <b>,<s>,<a>  split the first level: instructions are fetched from a separate\n");
+    printf("                    read-only cache of this geometry, the positional geometry is the data cache\n");
+    printf("  --write <p>       write policy of the first level data cache: back (default) or through\n");
+    printf("  --no-write-allocate  store misses write around the data cache instead of filling it\n");
+    printf("  --write-buffer <n>,<i>  write-through buffer of n block entries, one draining every\n");
+    printf("                    i instructions (default 8,4; 0 entries writes straight down)\n");
+    printf("  --victim <n>      put a fully associative victim cache of n blocks beside the data cache\n");
+    printf("  --prefetch <p>    data cache prefetcher: next-line, stride (per-PC) or stream (stream buffers)\n");
+    printf("  --prefetch-degree <d>,<f>  blocks fetched per trigger (the depth of each stream buffer)\n");
+    printf("                    and how far ahead the first one is (default 1,1)\n");
+    printf("  --prefetch-latency <n>  instructions a prefetch takes to arrive, uses sooner are late (default 8)\n");
+    printf("  --stream-buffers <n>  number of stream buffers for --prefetch stream (default 4)\n");
+    printf("  --mshrs <n>[,<l>]  make the data cache lockup-free with n MSHRs, each fill outstanding\n");
+    printf("                    for l cycles (default 20)\n");
+    printf("  --latency <h>,<m>,<r>,<w>  cycles of a first level hit, of a miss at any level before it\n");
+    printf("                    goes below, of a memory read and of a memory write (default 1,1,100,20)\n");
+    printf("  --exec-latency <a>,<n>,<b>,<j>  execution cycles of add, nand, beq and jalr (default 1 each)\n");
+    printf("  --cores <n>       run n copies of the program on one shared memory, each core with its own\n");
+    printf("                    coherent cache and its number in register 7\n");
+    printf("  --coherence <p>   snooping protocol for --cores: mesi (default) or moesi\n");
+    printf("  --quantum <n>     instructions each core runs per turn (default 1)\n");
+    printf("  --dispatch <e>    interpreter engine: threaded (computed gotos, the default where the compiler\n");
+    printf("                    has them and the geometry is a power of two), switch, or jit (basic blocks\n");
+    printf("                    translated to x86-64, for single core runs)\n");
+    printf("  --sectors <n>     split each data cache block into n sectors with their own valid and dirty bits\n");
+    printf("  --vm <words>      translate addresses through a TLB and a page table with pages of this size\n");
+    printf("  --tlb <s>,<a>[,<l>]   sets, associativity and hit latency of the TLB (default 4,4,1)\n");
+    printf("  --tlb2 <s>,<a>[,<l>]  add a second level TLB (hit latency defaults to 6)\n");
+    printf("  --vipt            index the first level caches virtually, overlapping the TLB lookup\n");
+    printf("  --parallel <m>    run each core on its own thread, strict (same result as serial)\n");
+    printf("                    or relaxed (cores run at once between barriers, no transfer trace)\n");
+    printf("  --sample <u>,<w>,<p>  estimate CPI and miss rates from units of u detailed instructions,\n");
+    printf("                    each after w of warming, one per p instructions; the rest only warms\n");
+    printf("                    the cache tags\n");
+    printf("  --sample-error <e>  rerun with more units until the CPI is known to within e percent\n");
+    printf("                    at 95%% confidence (default 3)\n");
+    printf("  --simpoint-profile <f>  profile basic block vectors per interval, cluster them and write\n");
+    printf("                    the representative intervals and their weights to f (no cache is simulated)\n");
+    printf("  --simpoint-interval <n>  instructions per profiled interval (default 10000)\n");
+    printf("  --simpoint-max-k <k>  most clusters to try, 1 to 100 (default 10)\n");
+    printf("  --simpoint-replay <f>  simulate only the intervals listed in f, each from a checkpoint,\n");
+    printf("                    and print weighted whole program estimates\n");
+    printf("  --simpoint-warming <n>  detailed instructions before each replayed interval (default 0)\n");
+    printf("  --checkpoint-save <f>  write the machine and cache state to f once --checkpoint-at\n");
+    printf("                    instructions have run, then carry on\n");
+    printf("  --checkpoint-at <n>  instructions before the checkpoint is written\n");
+    printf("  --checkpoint-trace <n>  accesses kept in the checkpoint to rewarm caches of another\n");
+    printf("                    shape (default 65536)\n");
+    printf("  --checkpoint-restore  the file argument is a checkpoint to start from, not machine code;\n");
+    printf("                    the caches come back as saved if they have the same shape, else are rewarmed\n");
+}
+
+/*
+ * Checks the --level geometries against the first level's block size and the
+ * inclusion policy. Inclusive levels must hold whole blocks of the level
+ * above, exclusive levels swap whole blocks so they must match it.
+ */
+int checkLevels(int firstBlockSize, const replPolicy* policy)
+{
+    if ((numLowerLevels > 0 || splitCaches || numCores > 1) && policy->needsFuture) {
+        printf("The %s policy only models a single cache\n", policy->name);
+        return -1;
+    }
+    if (prefetchKind != PREFETCH_NONE && policy->needsFuture) {
+        printf("The %s policy cannot be combined with prefetching\n", policy->name);
+        return -1;
+    }
+    if (!writeAllocate && policy->needsFuture) {
+        //a store miss that allocates nothing is neither a touch nor a fill, so the policy would lose its place
+        printf("The %s policy cannot be combined with --no-write-allocate\n", policy->name);
+        return -1;
+    }
+    if (numCores > 1 && (splitCaches || victimEntries > 0 || prefetchKind != PREFETCH_NONE || numMshrs > 0 ||
+                         writePolicy == WRITE_THROUGH || !writeAllocate ||
+                         (inclusionPolicy == EXCLUSIVE && numLowerLevels > 0))) {
+        printf("--cores needs plain write-back, write-allocate private caches: no --icache, --victim,\n");
+        printf("--prefetch, --mshrs or exclusive levels\n");
+        return -1;
+    }
+    if (numSectors > 0 && firstBlockSize % numSectors != 0) {
+        printf("--sectors must divide the block size\n");
+        return -1;
+    }
+    if (numSectors > 0 && (victimEntries > 0 || prefetchKind != PREFETCH_NONE || numMshrs > 0 ||
+                           (inclusionPolicy == EXCLUSIVE && numLowerLevels > 0))) {
+        printf("--sectors cannot be combined with --victim, --prefetch, --mshrs or exclusive levels\n");
+        return -1;
+    }
+    if (sampleUnit > 0 && (victimEntries > 0 || prefetchKind != PREFETCH_NONE || numMshrs > 0 || numSectors > 0 ||
+                           vmPageSize > 0 || policy->needsFuture ||
+                           (inclusionPolicy == EXCLUSIVE && numLowerLevels > 0))) {
+        printf("--sample cannot be combined with --victim, --prefetch, --mshrs, --sectors, --vm,\n");
+        printf("exclusive levels or the %s policy\n", policy->needsFuture ? policy->name : "opt");
+        return -1;
+    }
+    if (simpointMode == SIMPOINT_REPLAY && (vmPageSize > 0 || policy->needsFuture)) {
+        printf("--simpoint-replay starts from checkpoints, which --vm and the %s policy cannot\n",
+               policy->needsFuture ? policy->name : "opt");
+        return -1;
+    }
+    if ((checkpointSaveFile != NULL || checkpointRestore) &&
+        (victimEntries > 0 || prefetchKind != PREFETCH_NONE || numMshrs > 0 || numSectors > 0 || vmPageSize > 0 ||
+         policy->needsFuture || (writePolicy == WRITE_THROUGH && writeBufferEntries > 0) ||
+         (inclusionPolicy == EXCLUSIVE && numLowerLevels > 0))) {
+        printf("Checkpoints cannot be combined with --victim, --prefetch, --mshrs, --sectors, --vm,\n");
+        printf("a write buffer, exclusive levels or the %s policy\n", policy->needsFuture ? policy->name : "opt");
+        return -1;
+    }
+    if (vmPageSize > 0 && policy->needsFuture) {
+        printf("The %s policy cannot be combined with --vm\n", policy->name);
+        return -1;
+    }
+    if (vmPageSize == 0 && viptIndexing) {
+        printf("--vipt needs --vm\n");
+        return -1;
+    }
+    if (viptIndexing && (firstBlockSize * numbrSets > vmPageSize ||
+                         (splitCaches && icacheGeometry[0] * icacheGeometry[1] > vmPageSize))) {
+        printf("--vipt needs every way of the first level caches to fit in a page\n");
+        return -1;
+    }
+    if (prefetchKind == PREFETCH_STREAM && inclusionPolicy == EXCLUSIVE && numLowerLevels > 0) {
+        printf("Stream buffers cannot fill from exclusive levels\n");
+        return -1;
+    }
+    if (splitCaches && policy->pow2Ways && log2Exact(icacheGeometry[2]) < 0) {
+        printf("The %s policy needs a power of two associativity\n", policy->name);
+        return -1;
+    }
+    if (inclusionPolicy == EXCLUSIVE && numLowerLevels > 0 &&
+        (writePolicy == WRITE_THROUGH || !writeAllocate)) {
+        printf("Exclusive levels need a write-back, write-allocate first level\n");
+        return -1;
+    }
+    int upperBlockSize = firstBlockSize;
+    for (int l = 0; l < numLowerLevels; l++) {
+        int lowerBlockSize = lowerLevels[l][0];
+        if (inclusionPolicy == INCLUSIVE && (lowerBlockSize % upperBlockSize != 0 ||
+            (l == 0 && splitCaches && lowerBlockSize % icacheGeometry[0] != 0))) {
+            printf("Inclusive levels need block sizes that are multiples of the level above\n");
+            return -1;
+        }
+        if (inclusionPolicy == EXCLUSIVE && (lowerBlockSize != upperBlockSize ||
+            (l == 0 && splitCaches && lowerBlockSize != icacheGeometry[0]))) {
+            printf("Exclusive levels need the same block size as the level above\n");
+            return -1;
+        }
+        if (policy->pow2Ways && log2Exact(lowerLevels[l][2]) < 0) {
+            printf("The %s policy needs a power of two associativity\n", policy->name);
+            return -1;
+        }
+        upperBlockSize = lowerBlockSize;
+    }
+    return 0;
+}
+
+/*
+ * Pulls the options out of argv into the globals above and collects the
+ * remaining positional arguments into args. Returns the number of positional
+ * arguments, or -1 if the command line is malformed.
+ */
+int parseOptions(int argc, char** argv, char** args, int maxArgs)
+{
+    int numArgs = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--policy") == 0 && i + 1 < argc) {
+            policyName = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            randomSeed = (unsigned int) strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            printTransfers = false;
+        } else if (strcmp(argv[i], "--stack-distance") == 0) {
+            stackDistanceMode = true;
+        } else if (strcmp(argv[i], "--sweep") == 0) {
+            sweepMode = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            numThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--level") == 0 && i + 1 < argc) {
+            int *level = lowerLevels[numLowerLevels];
+            level[3] = DEFAULT_LOWER_HIT_LATENCY;
+            if (numLowerLevels == MAX_LEVELS ||
+                sscanf(argv[++i], "%d,%d,%d,%d", &level[0], &level[1], &level[2], &level[3]) < 3 ||
+                level[0] < 1 || level[1] < 1 || level[2] < 1 || level[3] < 0) {
+                printf("--level takes <block size>,<sets>,<associativity>[,<hit latency>], at most %d times\n",
+                       MAX_LEVELS);
+                return -1;
+            }
+            numLowerLevels++;
+        } else if (strcmp(argv[i], "--icache") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d,%d,%d", &icacheGeometry[0], &icacheGeometry[1],
+                       &icacheGeometry[2]) != 3 ||
+                icacheGeometry[0] < 1 || icacheGeometry[1] < 1 || icacheGeometry[2] < 1) {
+                printf("--icache takes <block size>,<sets>,<associativity>\n");
+                return -1;
+            }
+            splitCaches = true;
+        } else if (strcmp(argv[i], "--write") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "back") == 0) {
+                writePolicy = WRITE_BACK;
+            } else if (strcmp(argv[i], "through") == 0) {
+                writePolicy = WRITE_THROUGH;
+            } else {
+                printf("Unknown write policy '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--victim") == 0 && i + 1 < argc) {
+            victimEntries = atoi(argv[++i]);
+            if (victimEntries < 1) {
+                printf("--victim takes the number of blocks, 1 or greater\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--prefetch") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "next-line") == 0) {
+                prefetchKind = PREFETCH_NEXT_LINE;
+            } else if (strcmp(argv[i], "stride") == 0) {
+                prefetchKind = PREFETCH_STRIDE;
+            } else if (strcmp(argv[i], "stream") == 0) {
+                prefetchKind = PREFETCH_STREAM;
+            } else {
+                printf("Unknown prefetcher '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--prefetch-degree") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d,%d", &prefetchDegree, &prefetchDistance) < 1 ||
+                prefetchDegree < 1 || prefetchDistance < 1) {
+                printf("--prefetch-degree takes <degree>[,<distance>], both 1 or greater\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--prefetch-latency") == 0 && i + 1 < argc) {
+            prefetchLatency = atoi(argv[++i]);
+            if (prefetchLatency < 0) {
+                printf("--prefetch-latency takes a number of instructions, 0 or greater\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--stream-buffers") == 0 && i + 1 < argc) {
+            numStreamBuffers = atoi(argv[++i]);
+            if (numStreamBuffers < 1) {
+                printf("--stream-buffers takes the number of buffers, 1 or greater\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--mshrs") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d,%d", &numMshrs, &mshrLatency) < 1 || numMshrs < 1 || mshrLatency < 1) {
+                printf("--mshrs takes <entries>[,<latency>], both 1 or greater\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d,%d,%d,%d", &hitLatency, &missLatency, &memoryLatency,
+                       &writeLatency) < 1 ||
+                hitLatency < 0 || missLatency < 0 || memoryLatency < 0 || writeLatency < 0) {
+                printf("--latency takes <hit>[,<miss>[,<memory>[,<write>]]] cycles, 0 or greater\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--exec-latency") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d,%d,%d,%d", &execLatency[ADD], &execLatency[NAND], &execLatency[BEQ],
+                       &execLatency[JALR]) < 1 ||
+                execLatency[ADD] < 0 || execLatency[NAND] < 0 || execLatency[BEQ] < 0 || execLatency[JALR] < 0) {
+                printf("--exec-latency takes <add>[,<nand>[,<beq>[,<jalr>]]] cycles, 0 or greater\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--cores") == 0 && i + 1 < argc) {
+            numCores = atoi(argv[++i]);
+            if (numCores < 1 || numCores > MAX_CORES) {
+                printf("--cores takes a number of cores from 1 to %d\n", MAX_CORES);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--coherence") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "mesi") == 0) {
+                coherenceProtocol = MESI;
+            } else if (strcmp(argv[i], "moesi") == 0) {
+                coherenceProtocol = MOESI;
+            } else {
+                printf("Unknown coherence protocol '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--parallel") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "strict") == 0) {
+                parallelMode = PARALLEL_STRICT;
+            } else if (strcmp(argv[i], "relaxed") == 0) {
+                parallelMode = PARALLEL_RELAXED;
+            } else {
+                printf("Unknown parallel mode '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--vm") == 0 && i + 1 < argc) {
+            vmPageSize = atoi(argv[++i]);
+            if (log2Exact(vmPageSize) < 2 || vmPageSize > NUMMEMORY / 16) {
+                printf("--vm takes a page size in words, a power of two from 4 to %d\n", NUMMEMORY / 16);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--tlb") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d,%d,%d", &tlbGeometry[0], &tlbGeometry[1], &tlbGeometry[2]) < 2 ||
+                tlbGeometry[0] < 1 || tlbGeometry[1] < 1 || tlbGeometry[2] < 0) {
+                printf("--tlb takes <sets>,<associativity>[,<hit latency>]\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--tlb2") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d,%d,%d", &tlb2Geometry[0], &tlb2Geometry[1], &tlb2Geometry[2]) < 2 ||
+                tlb2Geometry[0] < 1 || tlb2Geometry[1] < 1 || tlb2Geometry[2] < 0) {
+                printf("--tlb2 takes <sets>,<associativity>[,<hit latency>]\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--dispatch") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "switch") == 0) {
+                dispatchMode = DISPATCH_SWITCH;
+            } else if (strcmp(argv[i], "threaded") == 0 && HAVE_COMPUTED_GOTO) {
+                dispatchMode = DISPATCH_THREADED;
+            } else if (strcmp(argv[i], "threaded") == 0) {
+                printf("This build has no threaded dispatch, it needs a compiler with computed gotos\n");
+                return -1;
+            } else if (strcmp(argv[i], "jit") == 0 && HAVE_JIT) {
+                dispatchMode = DISPATCH_JIT;
+            } else if (strcmp(argv[i], "jit") == 0) {
+                printf("This build has no JIT, it needs GCC on x86-64 Linux\n");
+                return -1;
+            } else {
+                printf("Unknown dispatch engine '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--sectors") == 0 && i + 1 < argc) {
+            numSectors = atoi(argv[++i]);
+            if (numSectors < 1) {
+                printf("--sectors takes the number of sectors per block, 1 or greater\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d,%d,%lld", &sampleUnit, &sampleWarming, &samplePeriod) != 3 ||
+                sampleUnit < 1 || sampleWarming < 0 || samplePeriod < sampleUnit + sampleWarming) {
+                printf("--sample takes <unit>,<warming>,<period> with the period at least unit + warming\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--sample-error") == 0 && i + 1 < argc) {
+            sampleError = atof(argv[++i]);
+            if (sampleError <= 0) {
+                printf("--sample-error takes a percentage greater than 0\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--simpoint-profile") == 0 && i + 1 < argc) {
+            simpointMode = SIMPOINT_PROFILE;
+            simpointFile = argv[++i];
+        } else if (strcmp(argv[i], "--simpoint-replay") == 0 && i + 1 < argc) {
+            simpointMode = SIMPOINT_REPLAY;
+            simpointFile = argv[++i];
+        } else if (strcmp(argv[i], "--simpoint-interval") == 0 && i + 1 < argc) {
+            simpointInterval = atoll(argv[++i]);
+            if (simpointInterval < 1) {
+                printf("--simpoint-interval takes the instructions per interval, 1 or greater\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--simpoint-max-k") == 0 && i + 1 < argc) {
+            simpointMaxK = atoi(argv[++i]);
+            if (simpointMaxK < 1 || simpointMaxK > 100) {
+                printf("--simpoint-max-k takes a number of clusters from 1 to 100\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--simpoint-warming") == 0 && i + 1 < argc) {
+            simpointWarming = atoll(argv[++i]);
+            if (simpointWarming < 0) {
+                printf("--simpoint-warming takes a number of instructions, 0 or greater\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--checkpoint-save") == 0 && i + 1 < argc) {
+            checkpointSaveFile = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-at") == 0 && i + 1 < argc) {
+            checkpointAt = atoll(argv[++i]);
+            if (checkpointAt < 1) {
+                printf("--checkpoint-at takes a number of instructions, 1 or greater\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--checkpoint-trace") == 0 && i + 1 < argc) {
+            checkpointTrace = atoll(argv[++i]);
+            if (checkpointTrace < 0 || checkpointTrace > INT_MAX) {
+                printf("--checkpoint-trace takes a number of accesses, 0 or greater\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--checkpoint-restore") == 0) {
+            checkpointRestore = true;
+        } else if (strcmp(argv[i], "--vipt") == 0) {
+            viptIndexing = true;
+        } else if (strcmp(argv[i], "--quantum") == 0 && i + 1 < argc) {
+            coreQuantum = atoi(argv[++i]);
+            if (coreQuantum < 1) {
+                printf("--quantum takes a number of instructions, 1 or greater\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--no-write-allocate") == 0) {
+            writeAllocate = false;
+        } else if (strcmp(argv[i], "--write-buffer") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d,%d", &writeBufferEntries, &writeBufferDrain) != 2 ||
+                writeBufferEntries < 0 || writeBufferDrain < 1) {
+                printf("--write-buffer takes <entries>,<drain interval>\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--inclusion") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "nine") == 0) {
+                inclusionPolicy = NINE;
+            } else if (strcmp(argv[i], "inclusive") == 0) {
+                inclusionPolicy = INCLUSIVE;
+            } else if (strcmp(argv[i], "exclusive") == 0) {
+                inclusionPolicy = EXCLUSIVE;
+            } else {
+                printf("Unknown inclusion policy '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            printf("Unknown or incomplete option '%s'\n", argv[i]);
+            return -1;
+        } else if (numArgs < maxArgs) {
+            args[numArgs++] = argv[i];
+        } else {
+            return -1;
+        }
+    }
+    return numArgs;
+}
+
+int main(int argc, char** argv) {
+
+    /** Get command line arguments **/
+    char *fname = (char *) malloc(sizeof(char) * 100);;
+    FILE *fp = (FILE *) malloc(sizeof(FILE));
+    char *args[4];
+
+    int numArgs = parseOptions(argc, argv, args, 4);
+    if (numArgs != 0 && numArgs != 4) {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    if (parallelMode != PARALLEL_OFF && numCores < 2) {
+        printf("--parallel needs --cores of 2 or more\n");
+        return -1;
+    }
+    if ((stackDistanceMode || sweepMode) && splitCaches) {
+        printf("--icache cannot be combined with --stack-distance or --sweep\n");
+        return -1;
+    }
+    if ((stackDistanceMode || sweepMode || numCores > 1) && numSectors > 0) {
+        printf("--sectors cannot be combined with --stack-distance, --sweep or --cores\n");
+        return -1;
+    }
+    if ((stackDistanceMode || sweepMode || numCores > 1) && vmPageSize > 0) {
+        printf("--vm cannot be combined with --stack-distance, --sweep or --cores\n");
+        return -1;
+    }
+    if ((stackDistanceMode || sweepMode || numCores > 1) && sampleUnit > 0) {
+        printf("--sample cannot be combined with --stack-distance, --sweep or --cores\n");
+        return -1;
+    }
+    if ((stackDistanceMode || sweepMode || numCores > 1 || sampleUnit > 0) && simpointMode != SIMPOINT_OFF) {
+        printf("--simpoint-profile and --simpoint-replay cannot be combined with --stack-distance, --sweep,\n");
+        printf("--cores or --sample\n");
+        return -1;
+    }
+    if ((stackDistanceMode || sweepMode || numCores > 1 || sampleUnit > 0 || simpointMode != SIMPOINT_OFF) &&
+        (checkpointSaveFile != NULL || checkpointRestore)) {
+        printf("--checkpoint-save and --checkpoint-restore cannot be combined with --stack-distance, --sweep,\n");
+        printf("--cores, --sample or --simpoint-profile/--simpoint-replay\n");
+        return -1;
+    }
+    if ((checkpointSaveFile != NULL) != (checkpointAt > 0)) {
+        printf("--checkpoint-save and --checkpoint-at go together\n");
+        return -1;
+    }
+    if ((stackDistanceMode || sweepMode) && numCores > 1) {
+        printf("--cores cannot be combined with --stack-distance or --sweep\n");
+        return -1;
+    }
+    if ((stackDistanceMode || sweepMode) && (numLowerLevels > 0 || inclusionPolicy != NINE)) {
+        printf("--level and --inclusion cannot be combined with --stack-distance or --sweep\n");
+        return -1;
+    }
+
+    if (stackDistanceMode) {
+        if (numArgs != 4) {
+            printUsage(argv[0]);
+            return -1;
+        }
+        return stackDistanceMain(args);
+    }
+
+    const replPolicy *policy = findPolicy(policyName);
+    if (policy == NULL) {
+        printf("Unknown replacement policy '%s'\n", policyName);
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    if (sweepMode) {
+        if (numArgs != 4) {
+            printUsage(argv[0]);
+            return -1;
+        }
+        return sweepMain(args, policy);
+    }
+
+    if (numArgs == 4) {
+        fname[0] = '\0';
+
+        strncat(fname, args[0], 99);
+        fp = fopen(fname, "r");
+        if (fp == NULL) {
+            printf("Cannot open file '%s' : %s\n", fname, strerror(errno));
+            return -1;
+        }
+
+        blockSize = atoi(args[1]);
+        numbrSets = atoi(args[2]);
+        associt = atoi(args[3]);
+        if (blockSize < 1 || numbrSets < 1 || associt < 1) {
+            printf("Block size, number of sets and associativity must all be 1 or greater\n");
+            return -1;
+        }
+
+    } else {
+        //TODO error check the input
+
+        //Takes in the parameters if they are not in the commnad line
+
+
+        printf("\nEnter the machine code program to simulate: ");
+        fgets(fname, 100, stdin);
+        fname[strlen(fname) - 1] = '\0';
+        fp = fopen(fname, "r");
+        while (1) {
+            if (fp == NULL) {
+                printf("The file you entered does not exist. Please enter another one: ");
+                fgets(fname, 100, stdin);
+                fname[strlen(fname) - 1] = '\0';
+                fp = fopen(fname, "r");
+            } else {
+                break;
+            }
+        }
+
+        printf("\nEnter the block size of the cache (in words, 1 or greater): ");
+        scanf("%d", &blockSize);
+        while (blockSize < 1) {
+            printf("\nThe number you entered is not in the range (1 or greater). Please enter again: ");
+            scanf("%d", &blockSize);
+        }
+
+        printf("\nEnter the number of sets in the cache (1 or greater): ");
+        scanf("%d", &numbrSets);
+        while (numbrSets < 1) {
+            printf("\nThe number you entered is not in the range (1 or greater). Please enter again: ");
+            scanf("%d", &numbrSets);
+        }
+
+        printf("\nEnter the associativity of the cache (1 or greater): ");
+        scanf("%d", &associt);
+        while (associt < 1) {
+            printf("\nThe number you entered is not in the range (1 or greater). Please enter again: ");
+            scanf("%d", &associt);
+        }
+    }//else if
+
+    if (checkLevels(blockSize, policy) != 0) {
+        return -1;
+    }
+
+    checkpointType checkpoint;
+    stateType *state;
+    if (checkpointRestore) {
+        fclose(fp);
+        if (openCheckpoint(&checkpoint, fname) != 0) {
+            return -1;
+        }
+        state = checkpointState(&checkpoint);
+    } else {
+        state = loadState(fp);
+    }
+    if (numCores > 1) {
+        int status = multicoreMain(state, policy);
+        freeState(state);
+        free(fname);
+        return status;
+    }
+    if (simpointMode != SIMPOINT_OFF) {
+        int status = simpointMode == SIMPOINT_PROFILE ? simpointProfileMain(state) : simpointReplayMain(state, policy);
+        freeState(state);
+        free(fname);
+        return status;
+    }
+    if (sampleUnit > 0) {
+        int status = samplingMain(state, policy);
+        freeState(state);
+        free(fname);
+        return status;
+    }
+    if (policy->needsFuture) {
+        traceAccesses(state, &oracleTrace);
+    }
+    cacheType *icache;
+    cacheType *cache = newHierarchy(policy, &icache);
+    free(oracleTrace.addrs);
+    oracleTrace.addrs = NULL;
+    timingType timing;
+    memset(&timing, 0, sizeof(timing));
+    attachTiming(icache, cache, &timing);
+    if (vmPageSize > 0) {
+        cache->vm = newVm(state, findPolicy("lru"));
+        icache->vm = cache->vm;
+    }
+    if (checkpointRestore) {
+        printf("CHECKPOINT INSTRUCTIONS: %lld\n", (long long) checkpoint.header->instructions);
+        if (restoreCaches(&checkpoint, state, icache, cache)) {
+            printf("CHECKPOINT CACHES: restored\n");
+        } else {
+            printf("CHECKPOINT CACHES: rewarmed from %lld accesses\n", (long long) checkpoint.header->traceLength);
+        }
+        closeCheckpoint(&checkpoint);
+    }
+
+    /** Run the simulation **/
+    if (checkpointSaveFile != NULL) {
+        print_stats(runSavingCheckpoint(state, icache, cache), icache, cache);
+    } else {
+        print_stats(run(state, icache, cache), icache, cache);
+    }
+
+    if (cache->vm != NULL) {
+        freeVm(cache->vm);
+    }
+    freeHierarchy(icache, cache);
+    freeState(state);
     free(fname);
 
 }